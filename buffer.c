@@ -20,36 +20,159 @@
  *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define _GNU_SOURCE		/* memfd_create */
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 
 #include "config.h"
 #include "defs.h"
 #include "buffer.h"
 #include "util.h"
+#include "slab.h"
+
+/*
+ * Flat rings are split into RB_CHUNK sized pieces that are only
+ * allocated while they hold data (or are about to be written), from a
+ * pool shared by every connection.  An idle ring costs the struct and
+ * its table of chunk pointers and nothing else.
+ */
+static struct slab_cache chunk_slab;
+
+long long rb_bytes_used = 0;
+long long rb_bytes_reserved = 0;
+
+#define CHUNK_OF(pos)	((pos) / RB_CHUNK)
+
+static uchar *
+rb_chunk (struct ringbuf *r, int k)
+{
+	if (!r->chunk[k])
+		r->chunk[k] = slab_alloc (&chunk_slab);
+	return r->chunk[k];
+}
+
+// does chunk k overlap the data between w_pos - used and w_pos?
+static int
+rb_live (struct ringbuf const *r, int k)
+{
+	int d = k * RB_CHUNK - (r->w_pos - r->used);
+
+	if (r->used == 0)
+		return 0;
+	if (d < 0)
+		d += r->size;
+	if (d >= r->size)
+		d -= r->size;
+	return d < r->used || d + RB_CHUNK > r->size;
+}
+
+// give back the unused chunks among the count starting at chunk k
+static void
+rb_release (struct ringbuf *r, int k, int count)
+{
+	int n = r->size / RB_CHUNK;
+
+	for (k %= n; count > 0; --count, k = (k + 1) % n)
+		if (r->chunk[k] && !rb_live (r, k)) {
+			slab_free (&chunk_slab, r->chunk[k]);
+			r->chunk[k] = NULL;
+		}
+}
+
+/*
+ * Map the same pages twice, back to back, so that the byte after the
+ * end of the ring is its first byte again.  Then every free or filled
+ * region is one contiguous span, whatever the wrap point.
+ */
+static uchar *
+rb_map_mirror (int size)
+{
+#ifdef MFD_CLOEXEC
+	uchar *p;
+	int fd;
+
+	fd = memfd_create ("ringbuf", MFD_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (ftruncate (fd, size) < 0) {
+		close (fd);
+		return NULL;
+	}
+	p = mmap (NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		close (fd);
+		return NULL;
+	}
+	if (mmap (p, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+	    || mmap (p + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap (p, 2 * size);
+		close (fd);
+		return NULL;
+	}
+	close (fd);
+	return p;
+#else
+	return NULL;
+#endif
+}
 
 struct ringbuf *
 rb_new (int s)
 {
 	struct ringbuf *r;
+	int page;
+
+	if (!chunk_slab.size)
+		slab_init (&chunk_slab, "ringbuf chunk", RB_CHUNK, CACHE_LINE, 32);
 
 	r = ALLOC (sizeof (struct ringbuf));
-	r->size = s;
 	r->p = NULL;
+	r->chunk = NULL;
 	r->w_pos = 0;
 	r->w_seq = 0;
 	r->used = 0;
+	r->mirrored = 0;
+
+	// big buffers are mapped once and kept; smaller ones are built
+	// from pooled chunks as data arrives
+	if (globals.ring_mirror_min > 0 && s >= globals.ring_mirror_min) {
+		page = getpagesize ();
+		r->size = (s + page - 1) / page * page;
+		if ((r->p = rb_map_mirror (r->size))) {
+			r->mirrored = 1;
+			rb_bytes_reserved += r->size;
+			return r;
+		}
+		syslog (LOG_INFO, "can't mirror a %d byte ring buffer, using chunks\n", r->size);
+	}
+
+	r->size = (s + RB_CHUNK - 1) / RB_CHUNK * RB_CHUNK;
+	r->chunk = ALLOC (r->size / RB_CHUNK * sizeof (uchar *));
+	memset (r->chunk, 0, r->size / RB_CHUNK * sizeof (uchar *));
+	rb_bytes_reserved += r->size;
 	return r;
 }
 
 void
 rb_delete (struct ringbuf *r)
 {
-	if (r->p)
-		FREE (r->p);
+	int k;
+
+	rb_bytes_reserved -= r->size;
+	rb_bytes_used -= r->used;
+	if (r->mirrored)
+		munmap (r->p, 2 * r->size);
+	else {
+		for (k = 0; k < r->size / RB_CHUNK; ++k)
+			if (r->chunk[k])
+				slab_free (&chunk_slab, r->chunk[k]);
+		FREE (r->chunk);
+	}
 	FREE (r);
 }
 
@@ -62,19 +185,95 @@ rb_set (struct ringbuf *r, uint s)
 void
 rb_advance (struct ringbuf *r, uint s)
 {
+	int start = r->w_pos - r->used, gone = r->used;
+
 	r->used = r->w_seq - s;
 	if (r->used <= 0) {
 		r->used = 0;
 		r->w_seq = s;
 	}
-	if (r->used == 0) {
-		if (r->p) {
-			FREE (r->p);
+	gone -= r->used;
+	rb_bytes_used -= gone;
+	if (r->mirrored)
+		return;
+	if (start < 0)
+		start += r->size;
+	if (r->used == 0)
+		rb_release (r, 0, r->size / RB_CHUNK);
+	else if (gone > 0)
+		rb_release (r, CHUNK_OF (start), CHUNK_OF (start + gone) - CHUNK_OF (start));
+}
+
+/*
+ * Change the capacity of a ring, keeping its contents and sequence
+ * numbers.  Between flat rings only chunk pointers move; anything to
+ * or from a mirror copies the data once.  The size never drops below
+ * what is buffered.  Returns the new size.
+ */
+int
+rb_resize (struct ringbuf *r, int s)
+{
+	struct ringbuf *n, tmp;
+	struct iovec iov[RB_SPANS];
+	uchar **chunk;
+	int start, off, first, cnt, k, i, done;
+
+	if (s < r->used)
+		s = r->used;
+
+	if (r->mirrored || (globals.ring_mirror_min > 0 && s >= globals.ring_mirror_min)) {
+		n = rb_new (s);
+		if (n->size == r->size && n->mirrored == r->mirrored) {
+			rb_delete (n);
+			return r->size;
 		}
-		r->p = NULL;
-		r->w_pos = 0;
-		syslog (LOG_INFO, "Removing unused buffer.\n");
+		rb_set (n, r->w_seq - r->used);
+		for (done = 0; done < r->used; done += k)
+			for (i = 0, k = 0, cnt = rb_read_spans (r, n->w_seq, iov, RB_SPANS, r->used - done); i < cnt; ++i)
+				k += rb_write (n, iov[i].iov_base, iov[i].iov_len);
+		tmp = *r;
+		*r = *n;
+		*n = tmp;
+		rb_delete (n);
+		return r->size;
+	}
+
+	start = r->w_pos - r->used;
+	if (start < 0)
+		start += r->size;
+	off = start % RB_CHUNK;
+	if (s < off + r->used)
+		s = off + r->used;
+	s = (s + RB_CHUNK - 1) / RB_CHUNK * RB_CHUNK;
+	if (s == r->size)
+		return s;
+
+	// renumber the chunks holding data from 0, keeping the offset of
+	// the first byte inside its chunk
+	rb_release (r, 0, r->size / RB_CHUNK);
+	chunk = ALLOC (s / RB_CHUNK * sizeof (uchar *));
+	memset (chunk, 0, s / RB_CHUNK * sizeof (uchar *));
+	first = CHUNK_OF (start);
+	cnt = r->used ? CHUNK_OF (off + r->used - 1) + 1 : 0;
+	for (k = 0; k < cnt; ++k)
+		chunk[k] = r->chunk[(first + k) % (r->size / RB_CHUNK)];
+	// a full ring whose head and tail share a chunk: split the tail off
+	if (cnt > r->size / RB_CHUNK) {
+		chunk[cnt - 1] = slab_alloc (&chunk_slab);
+		memcpy (chunk[cnt - 1], chunk[0], off);
 	}
+	FREE (r->chunk);
+	r->chunk = chunk;
+	rb_bytes_reserved += s - r->size;
+	r->size = s;
+	r->w_pos = (off + r->used) % s;
+	return s;
+}
+
+int
+rb_size (struct ringbuf const *r)
+{
+	return r->size;
 }
 
 int
@@ -102,76 +301,144 @@ rb_avail (struct ringbuf const *r, uint seq)
 		return d;
 }
 
+/*
+ * Describe up to max bytes of the free space after the write position
+ * as at most niov iovecs, so a caller can readv() straight into the
+ * buffer.  Flat rings take chunks for just those bytes, so max should be
+ * what the caller expects to fill.  Nothing changes until rb_commit says
+ * how much was filled in.
+ */
 int
-rb_write (struct ringbuf *r, uchar * data, int len)
+rb_write_spans (struct ringbuf *r, struct iovec *iov, int niov, int max)
 {
-	int done = 0, cnt;
+	int left, pos, cnt, n = 0;
 
-	if (len == 0)
+	left = rb_left (r);
+	if (left > max)
+		left = max;
+	if (left <= 0 || niov == 0)
 		return 0;
 
-	if (r->p == NULL) {
-		r->p = ALLOC (r->size);
-		r->w_pos = 0;
-		r->used = 0;
+	if (r->mirrored) {
+		iov[0].iov_base = r->p + r->w_pos;
+		iov[0].iov_len = left;
+		return 1;
 	}
 
-	if (rb_left (r) < len)
-		len = rb_left (r);
+	for (pos = r->w_pos; left > 0 && n < niov; ++n) {
+		cnt = RB_CHUNK - pos % RB_CHUNK;
+		if (cnt > left)
+			cnt = left;
+		iov[n].iov_base = rb_chunk (r, CHUNK_OF (pos)) + pos % RB_CHUNK;
+		iov[n].iov_len = cnt;
+		left -= cnt;
+		pos = (pos + cnt) % r->size;
+	}
+	return n;
+}
 
-	cnt = r->size - r->w_pos;
-	if (len < cnt)
-		cnt = len;
+void
+rb_commit (struct ringbuf *r, int len)
+{
+	int k;
 
-	memcpy (r->p + r->w_pos, data + done, cnt);
-	len -= cnt;
-	done += cnt;
-	r->used += cnt;
-	r->w_pos += cnt;
+	r->used += len;
+	r->w_pos += len;
+	if (r->w_pos >= r->size)
+		r->w_pos -= r->size;
+	r->w_seq += len;
+	rb_bytes_used += len;
 
-	if (r->w_pos == r->size) {
-		if (len > 0) {
-			memcpy (r->p, data + done, len);
-			done += len;
-			r->used += len;
-			r->w_pos = len;
-		}
-		else
-			r->w_pos = 0;
+	// chunks handed out by rb_write_spans that didn't get filled
+	if (!r->mirrored) {
+		k = CHUNK_OF (r->w_pos + RB_CHUNK - 1);
+		rb_release (r, k, CHUNK_OF (r->w_pos + rb_left (r)) - k + 1);
 	}
-
-	r->w_seq += done;
-
-	return done;
 }
 
+/*
+ * Describe up to max bytes of data starting at seq as at most niov
+ * iovecs, for writev() straight out of the buffer.
+ */
 int
-rb_read (struct ringbuf *r, uint seq, uchar * data, int max)
+rb_read_spans (struct ringbuf const *r, uint seq, struct iovec *iov, int niov, int max)
 {
-	int back, pos, cnt, done = 0;
+	int back, pos, cnt, n = 0;
 
 	back = r->w_seq - seq;
-	if (back == 0 || r->used < back || max == 0)
+	if (back <= 0 || r->used < back || max <= 0)
 		return 0;
 
 	if (back < max)
 		max = back;
 
-	if (back > r->w_pos) {
-		cnt = back - r->w_pos;
-		pos = r->size - cnt;
+	pos = r->w_pos - back;
+	if (pos < 0)
+		pos += r->size;
+
+	if (r->mirrored) {
+		iov[0].iov_base = r->p + pos;
+		iov[0].iov_len = max;
+		return 1;
+	}
+
+	for (; max > 0 && n < niov; ++n) {
+		cnt = RB_CHUNK - pos % RB_CHUNK;
 		if (cnt > max)
 			cnt = max;
-		memcpy (data + done, r->p + pos, cnt);
+		iov[n].iov_base = r->chunk[CHUNK_OF (pos)] + pos % RB_CHUNK;
+		iov[n].iov_len = cnt;
 		max -= cnt;
+		pos = (pos + cnt) % r->size;
+	}
+	return n;
+}
+
+static int
+rb_copy_spans (struct iovec *iov, int n, uchar * data, int len, int out)
+{
+	int i, cnt, done = 0;
+
+	for (i = 0; i < n && done < len; ++i) {
+		cnt = iov[i].iov_len;
+		if (cnt > len - done)
+			cnt = len - done;
+		if (out)
+			memcpy (data + done, iov[i].iov_base, cnt);
+		else
+			memcpy (iov[i].iov_base, data + done, cnt);
 		done += cnt;
-		back -= cnt;
 	}
+	return done;
+}
 
-	if (max > 0) {
-		memcpy (data + done, r->p + r->w_pos - back, max);
-		done += max;
+int
+rb_write (struct ringbuf *r, uchar * data, int len)
+{
+	struct iovec iov[RB_SPANS];
+	int cnt, done = 0;
+
+	while (done < len) {
+		cnt = rb_copy_spans (iov, rb_write_spans (r, iov, RB_SPANS, len - done), data + done, len - done, 0);
+		if (cnt == 0)
+			break;
+		rb_commit (r, cnt);
+		done += cnt;
 	}
+	return done;
+}
 
+int
+rb_read (struct ringbuf *r, uint seq, uchar * data, int max)
+{
+	struct iovec iov[RB_SPANS];
+	int cnt, done = 0;
+
+	while (done < max) {
+		cnt = rb_copy_spans (iov, rb_read_spans (r, seq + done, iov, RB_SPANS, max - done), data + done, max - done, 1);
+		if (cnt == 0)
+			break;
+		done += cnt;
+	}
 	return done;
 }
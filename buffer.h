@@ -23,23 +23,38 @@
 #ifndef _BUFFER_H
 #define _BUFFER_H
 
+struct iovec;
+
+#define RB_CHUNK	2048	/* allocation unit of a flat ring */
+#define RB_SPANS	16	/* iovecs the copying helpers work through at once */
+
 struct ringbuf
 {
-	uchar *p;
+	uchar *p;		/* mirrored rings */
+	uchar **chunk;		/* flat rings, one pointer per RB_CHUNK bytes */
 	int size;
 	uint w_seq;
 	int w_pos;
 	int used;
+	int mirrored;		/* p is mapped twice, see rb_map_mirror */
 };
 
+extern long long rb_bytes_used;	/* data buffered in all rings */
+extern long long rb_bytes_reserved;	/* capacity of all rings */
+
 struct ringbuf *rb_new (int s);
 void rb_delete (struct ringbuf *r);
 void rb_set (struct ringbuf *r, uint s);
 void rb_advance (struct ringbuf *r, uint s);
+int rb_resize (struct ringbuf *r, int s);
+int rb_size (struct ringbuf const *r);
 int rb_left (struct ringbuf const *r);
 int rb_used (struct ringbuf const *r);
 int rb_avail (struct ringbuf const *r, uint seq);
 int rb_write (struct ringbuf *r, uchar * data, int len);
 int rb_read (struct ringbuf *r, uint seq, uchar * data, int max);
+int rb_write_spans (struct ringbuf *r, struct iovec *iov, int niov, int max);
+void rb_commit (struct ringbuf *r, int len);
+int rb_read_spans (struct ringbuf const *r, uint seq, struct iovec *iov, int niov, int max);
 
 #endif /* _BUFFER_H */
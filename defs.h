@@ -44,6 +44,8 @@ typedef unsigned char uchar;
 #define TCP_LAST_ACK		9
 #define TCP_TIME_WAIT		10
 
+#define UDP_CLASSES		16	/* udp_port_timeout lines */
+
 struct globals
 {
 	int debug;
@@ -51,6 +53,35 @@ struct globals
 	int plen;
 	char const *config_file;
 	unsigned short http_port;
+	int timewait_max;
+	int syn_cookie_threshold;	/* half-open connections, 0 = never */
+	int ecn;
+	int autocork;
+	int ring_mirror_min;	/* ring buffers this big are double-mapped, 0 = never */
+	int buffer_budget;	/* KB of connection buffers, 0 = unlimited */
+	int sched_quantum;	/* bytes per flow per transmit round */
+	int pacing;
+	int pacing_gain;	/* percent of cwnd per srtt */
+	int gro;
+	unsigned short splice_port;	/* transparent listener for kernel-terminated TCP, 0 = off */
+	int siit;		/* translate prefix-to-prefix packets statelessly via tun4 */
+	unsigned char pool4[4];	/* IPv4 pool of the stateful translator */
+	int pool4_len;		/* its prefix length, 0 = no stateful translation */
+	unsigned char source4[4];	/* source addresses for upstream sockets */
+	int source4_len;	/* 0 = let the kernel pick */
+	int source_port_min;	/* 0, 0 = the kernel's ephemeral range */
+	int source_port_max;
+	int udp_ports;		/* shared upstream UDP sockets, 0 = one per mapping */
+	int udp_offload;	/* UDP_GRO/UDP_SEGMENT and connected sockets upstream, narrows filtering */
+	int frag_memory;	/* KB held by IPv6 fragment reassembly */
+	int nat64_sessions;	/* NAT64 sessions before new ones are refused */
+	unsigned char dns64[4];	/* upstream resolver, answered for at prefix::dns64, 0.0.0.0 = no DNS64 */
+	int dns64_cache;	/* names kept by DNS64 */
+	int udp_timeout;	/* sec a UDP mapping outlives its last packet */
+	int udp_classes;
+	int udp_class[UDP_CLASSES][2];	/* destination port, its own udp_timeout */
+	int udp_maps_max;	/* UDP mappings before LRU eviction, 0 = from the fd limit */
+	unsigned char nodelay_ports[65536 / 8];	/* bitmap of ports exempt from autocork */
 };
 
 extern struct globals globals;
@@ -104,6 +104,9 @@ ether_setup (struct iface_ether *iface)
 	iface->iface.get_hwaddr = ether_get_hwaddr;
 	iface->iface.send_unicast = ether_send_unicast;
 	iface->iface.send_multicast = ether_send_multicast;
+	iface->iface.forward = NULL;
+	iface->iface.batch = 0;
+	iface->iface.batch_end = NULL;
 	iface->recv_frame = ether_pkt_in;
 	iface->head_size = 14;
 	return 0;
@@ -252,6 +252,10 @@ event_loop (void)
 					remove_event (e);
 			}
 		}
+		else if (always_event_list) {
+			t.tv_sec = t.tv_usec = 0;
+			ret = select (highfd + 1, &rfds, &wfds, NULL, &t);
+		}
 		else
 			ret = select (highfd + 1, &rfds, &wfds, NULL, NULL);
 
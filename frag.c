@@ -0,0 +1,281 @@
+/*
+ *  frag.c
+ *
+ *  ptrtd - Portable IPv6 TRT implementation
+ *
+ *  Copyright (C) 2001  Nathan Lutchansky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+#include "defs.h"
+#include "util.h"
+#include "event.h"
+#include "frag.h"
+
+/*
+ * IPv6 fragmentation (RFC 8200 section 4.5).  Datagrams too big for the
+ * interface are cut into fragments right after the IPv6 header, since we
+ * never emit extension headers of our own.
+ *
+ * Reassembly keeps one queue per (source, destination, identification)
+ * holding the fragments received so far, sorted by offset.  Every queue
+ * gets the same lifetime, so creation order is expiry order and one
+ * timer on the oldest queue is enough.  The fragments held are capped at
+ * globals.frag_memory KB; going over evicts the oldest queues first.  A
+ * fragment overlapping another one kills its datagram (RFC 5722), unless
+ * it is an exact copy of one already held.
+ */
+
+struct frag
+{
+	struct frag *next;	/* by offset */
+	int off;
+	int len;
+	uchar data[0];
+};
+
+struct frag_queue
+{
+	struct frag_queue *next;	/* oldest first */
+	struct frag_queue *prev;
+	uchar hdr[40];		/* IPv6 header of the first fragment */
+	uint id;
+	int nexthdr;		/* -1 until the first fragment is in */
+	int total;		/* payload length, -1 until the last fragment is in */
+	int have;		/* payload bytes received */
+	time_ref start;
+	struct frag *frags;
+};
+
+static struct frag_queue *fq_head = NULL, *fq_tail = NULL;
+static int fq_mem = 0;
+static uint frag_id = 0;
+static struct event *e_frag_expire = NULL;
+
+struct pbuf *
+frag_split (struct iface *iface, uchar const *pkt, int len)
+{
+	struct pbuf *head = NULL, *tail = NULL, *p;
+	int off, chunk, plen = len - 40, max = (iface->mtu - 48) & ~7;
+
+	if (!frag_id)
+		random_bytes ((uchar *) & frag_id, sizeof (frag_id));
+	++frag_id;
+
+	for (off = 0; off < plen; off += chunk) {
+		chunk = plen - off < max ? plen - off : max;
+		p = iface->get_buffer (iface, 48 + chunk);
+		memcpy (p->d, pkt, 40);
+		PUT_16 (p->d + 4, 8 + chunk);
+		p->d[6] = 44;
+		p->d[40] = pkt[6];
+		p->d[41] = 0;
+		PUT_16 (p->d + 42, off | (off + chunk < plen));
+		PUT_32 (p->d + 44, frag_id);
+		memcpy (p->d + 48, pkt + 40 + off, chunk);
+		p->dlen = 48 + chunk;
+		p->next = NULL;
+		if (tail)
+			tail->next = p;
+		else
+			head = p;
+		tail = p;
+	}
+	return head;
+}
+
+static void
+fq_free (struct frag_queue *q)
+{
+	struct frag *f;
+
+	while ((f = q->frags)) {
+		q->frags = f->next;
+		fq_mem -= sizeof (struct frag) + f->len;
+		FREE (f);
+	}
+	fq_mem -= sizeof (struct frag_queue);
+	if (q->prev)
+		q->prev->next = q->next;
+	else
+		fq_head = q->next;
+	if (q->next)
+		q->next->prev = q->prev;
+	else
+		fq_tail = q->prev;
+	FREE (q);
+}
+
+static int
+fq_expire (struct event *e, void *d)
+{
+	time_ref tr;
+
+	while (fq_head && time_ago (&fq_head->start) >= FRAG_TIMEOUT)
+		fq_free (fq_head);
+
+	if (!fq_head) {
+		e_frag_expire = NULL;
+		return 0;
+	}
+	tr = fq_head->start;
+	time_add (&tr, FRAG_TIMEOUT);
+	resched_time_event (e, &tr);
+	return 1;
+}
+
+static struct frag_queue *
+fq_find (uchar const *p, uint id)
+{
+	struct frag_queue *q;
+	time_ref tr;
+
+	for (q = fq_head; q; q = q->next)
+		if (q->id == id && !memcmp (q->hdr + 8, p + 8, 32))
+			return q;
+
+	q = ALLOC (sizeof (struct frag_queue));
+	memcpy (q->hdr, p, 40);
+	q->id = id;
+	q->nexthdr = -1;
+	q->total = -1;
+	q->have = 0;
+	q->frags = NULL;
+	time_now (&q->start);
+	fq_mem += sizeof (struct frag_queue);
+	q->next = NULL;
+	q->prev = fq_tail;
+	if (fq_tail)
+		fq_tail->next = q;
+	else
+		fq_head = q;
+	fq_tail = q;
+
+	if (!e_frag_expire) {
+		time_future (&tr, FRAG_TIMEOUT);
+		e_frag_expire = add_time_event (&tr, fq_expire, NULL);
+	}
+	return q;
+}
+
+/* the whole datagram, once every fragment of q is in */
+static struct pbuf *
+fq_assemble (struct frag_queue *q)
+{
+	struct pbuf *p;
+	struct frag *f;
+
+	p = pbuf_new (PBUF_HEADROOM + 40 + q->total);
+	pbuf_drop (p, PBUF_HEADROOM);
+	memcpy (p->d, q->hdr, 40);
+	PUT_16 (p->d + 4, q->total);
+	p->d[6] = q->nexthdr;
+	for (f = q->frags; f; f = f->next)
+		memcpy (p->d + 40 + f->off, f->data, f->len);
+	p->dlen = 40 + q->total;
+	fq_free (q);
+	return p;
+}
+
+/*
+ * Take in a packet whose next header is a Fragment header.  Returns the
+ * reassembled datagram when this fragment completes one (the caller
+ * deletes it), otherwise NULL.
+ */
+struct pbuf *
+frag_receive (uchar const *p, int len)
+{
+	struct frag_queue *q;
+	struct frag *f, **pp;
+	int off, dlen, more, cap = globals.frag_memory * 1024;
+	uint id;
+
+	if (len < 48 || GET_16 (p + 4) + 40 > len)
+		return NULL;
+	len = GET_16 (p + 4) + 40;
+	off = GET_16 (p + 42) & 0xfff8;
+	more = p[43] & 1;
+	id = GET_32 (p + 44);
+	dlen = len - 48;
+
+	// an atomic fragment is the datagram itself (RFC 6946)
+	if (!off && !more) {
+		struct pbuf *whole = pbuf_new (PBUF_HEADROOM + len - 8);
+
+		pbuf_drop (whole, PBUF_HEADROOM);
+		memcpy (whole->d, p, 40);
+		PUT_16 (whole->d + 4, dlen);
+		whole->d[6] = p[40];
+		memcpy (whole->d + 40, p + 48, dlen);
+		whole->dlen = len - 8;
+		return whole;
+	}
+	if (off + dlen > 65535 || (more && (dlen & 7)) || dlen <= 0)
+		return NULL;
+
+	q = fq_find (p, id);
+
+	for (f = q->frags; f; f = f->next)
+		if ((f->off < off + dlen && off < f->off + f->len) || (!more && f->off + f->len > off + dlen))
+			break;
+	// a retransmit of a fragment we hold is harmless
+	if (f && f->off == off && f->len == dlen && (q->total == off + dlen) == !more && !memcmp (f->data, p + 48, dlen))
+		return NULL;
+	if (f || (q->total >= 0 && (off + dlen > q->total || (!more && off + dlen != q->total)))) {
+		fq_free (q);
+		return NULL;
+	}
+
+	// make room, oldest datagrams first
+	while (fq_mem + sizeof (struct frag) + dlen > cap && fq_head != q)
+		fq_free (fq_head);
+	if (fq_mem + sizeof (struct frag) + dlen > cap) {
+		fq_free (q);
+		return NULL;
+	}
+	if (!more)
+		q->total = off + dlen;
+	if (!off) {
+		memcpy (q->hdr, p, 40);
+		q->nexthdr = p[40];
+	}
+
+	for (pp = &q->frags; *pp && (*pp)->off < off; pp = &(*pp)->next);
+	f = ALLOC (sizeof (struct frag) + dlen);
+	f->off = off;
+	f->len = dlen;
+	memcpy (f->data, p + 48, dlen);
+	f->next = *pp;
+	*pp = f;
+	q->have += dlen;
+	fq_mem += sizeof (struct frag) + dlen;
+
+	if (q->total >= 0 && q->have == q->total && q->nexthdr >= 0)
+		return fq_assemble (q);
+	return NULL;
+}
+
+int
+frag_memory (void)
+{
+	return fq_mem;
+}
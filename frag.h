@@ -0,0 +1,35 @@
+/*
+ *  frag.h
+ *
+ *  ptrtd - Portable IPv6 TRT implementation
+ *
+ *  Copyright (C) 2001  Nathan Lutchansky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _FRAG_H
+#define _FRAG_H
+
+#include "if.h"
+#include "pbuf.h"
+
+#define FRAG_TIMEOUT	60000	/* msec, RFC 8200 */
+
+struct pbuf *frag_split (struct iface *iface, uchar const *pkt, int len);
+struct pbuf *frag_receive (uchar const *p, int len);
+int frag_memory (void);
+
+#endif /* _FRAG_H */
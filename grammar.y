@@ -12,6 +12,7 @@ static char const * filename;
 
 %union {
     unsigned short p[4];
+    unsigned char a[4];
     char s[64];
     int d;
 }
@@ -20,6 +21,7 @@ static char const * filename;
 %token <d> PLEN
 %token <s> ID
 %token <p> PREFIX
+%token <a> IPV4
 
 %start settings
 
@@ -45,12 +47,146 @@ setting : ID '=' PREFIX PLEN ';'
                 unknown_symbol($1, yylineno);
             }
         }
+        | ID '=' IPV4 PLEN ';'
+        {
+            if(strcmp($1, "pool4") == 0 && $4 > 0 && $4 <= 32){
+                printf("using %s: %d.%d.%d.%d/%d \n", $1, ($3)[0], ($3)[1], ($3)[2], ($3)[3], $4);
+                memcpy(globals.pool4, $3, 4);
+                globals.pool4_len = $4;
+            }
+            else if(strcmp($1, "source4") == 0 && $4 > 0 && $4 <= 32){
+                printf("using %s: %d.%d.%d.%d/%d \n", $1, ($3)[0], ($3)[1], ($3)[2], ($3)[3], $4);
+                memcpy(globals.source4, $3, 4);
+                globals.source4_len = $4;
+            }
+            else {
+                unknown_symbol($1, yylineno);
+            }
+        }
+        | ID '=' IPV4 ';'
+        {
+            if(strcmp($1, "dns64") == 0){
+                printf("using %s: %d.%d.%d.%d \n", $1, ($3)[0], ($3)[1], ($3)[2], ($3)[3]);
+                memcpy(globals.dns64, $3, 4);
+            }
+            else {
+                unknown_symbol($1, yylineno);
+            }
+        }
+        | ID '=' INT ',' INT ';'
+        {
+            int i;
+
+            if(strcmp($1, "udp_port_timeout") == 0 && $3 > 0 && $3 < 65536){
+                printf("using %s: %d, %d \n", $1, $3, $5);
+                for(i=0; i < globals.udp_classes && globals.udp_class[i][0] != $3; ++i);
+                if(i == UDP_CLASSES){
+                    fprintf(stderr, "too many %s lines, %d at most\n", $1, UDP_CLASSES);
+                    exit(1);
+                }
+                if(i == globals.udp_classes)
+                    ++globals.udp_classes;
+                globals.udp_class[i][0] = $3;
+                globals.udp_class[i][1] = $5;
+            }
+            else {
+                unknown_symbol($1, yylineno);
+            }
+        }
         | ID '=' INT ';'
         {
             if(strcmp($1, "http_port") == 0){
                 printf("using %s: %d \n", $1, $3);
                 globals.http_port = $3;
             }
+            else if(strcmp($1, "timewait_max") == 0){
+                printf("using %s: %d \n", $1, $3);
+                globals.timewait_max = $3;
+            }
+            else if(strcmp($1, "syn_cookie_threshold") == 0){
+                printf("using %s: %d \n", $1, $3);
+                globals.syn_cookie_threshold = $3;
+            }
+            else if(strcmp($1, "ecn") == 0){
+                printf("using %s: %d \n", $1, $3);
+                globals.ecn = $3;
+            }
+            else if(strcmp($1, "autocork") == 0){
+                printf("using %s: %d \n", $1, $3);
+                globals.autocork = $3;
+            }
+            else if(strcmp($1, "ring_mirror_min") == 0){
+                printf("using %s: %d \n", $1, $3);
+                globals.ring_mirror_min = $3;
+            }
+            else if(strcmp($1, "buffer_budget") == 0){
+                printf("using %s: %d \n", $1, $3);
+                globals.buffer_budget = $3;
+            }
+            else if(strcmp($1, "sched_quantum") == 0 && $3 > 0){
+                printf("using %s: %d \n", $1, $3);
+                globals.sched_quantum = $3;
+            }
+            else if(strcmp($1, "pacing") == 0){
+                printf("using %s: %d \n", $1, $3);
+                globals.pacing = $3;
+            }
+            else if(strcmp($1, "pacing_gain") == 0 && $3 > 0){
+                printf("using %s: %d \n", $1, $3);
+                globals.pacing_gain = $3;
+            }
+            else if(strcmp($1, "gro") == 0){
+                printf("using %s: %d \n", $1, $3);
+                globals.gro = $3;
+            }
+            else if(strcmp($1, "splice_port") == 0){
+                printf("using %s: %d \n", $1, $3);
+                globals.splice_port = $3;
+            }
+            else if(strcmp($1, "siit") == 0){
+                printf("using %s: %d \n", $1, $3);
+                globals.siit = $3;
+            }
+            else if(strcmp($1, "source_port_min") == 0){
+                printf("using %s: %d \n", $1, $3);
+                globals.source_port_min = $3;
+            }
+            else if(strcmp($1, "source_port_max") == 0){
+                printf("using %s: %d \n", $1, $3);
+                globals.source_port_max = $3;
+            }
+            else if(strcmp($1, "udp_ports") == 0){
+                printf("using %s: %d \n", $1, $3);
+                globals.udp_ports = $3;
+            }
+            else if(strcmp($1, "udp_offload") == 0){
+                printf("using %s: %d \n", $1, $3);
+                globals.udp_offload = $3;
+            }
+            else if(strcmp($1, "frag_memory") == 0){
+                printf("using %s: %d \n", $1, $3);
+                globals.frag_memory = $3;
+            }
+            else if(strcmp($1, "nat64_sessions") == 0){
+                printf("using %s: %d \n", $1, $3);
+                globals.nat64_sessions = $3;
+            }
+            else if(strcmp($1, "dns64_cache") == 0){
+                printf("using %s: %d \n", $1, $3);
+                globals.dns64_cache = $3;
+            }
+            else if(strcmp($1, "udp_timeout") == 0 && $3 > 0){
+                printf("using %s: %d \n", $1, $3);
+                globals.udp_timeout = $3;
+            }
+            else if(strcmp($1, "udp_maps_max") == 0){
+                printf("using %s: %d \n", $1, $3);
+                globals.udp_maps_max = $3;
+            }
+            else if(strcmp($1, "nodelay_port") == 0 && $3 > 0 && $3 < 65536){
+                printf("using %s: %d \n", $1, $3);
+                globals.nodelay_ports[$3 >> 3] |= 1 << ($3 & 7);
+            }
             else {
                 unknown_symbol($1, yylineno);
             }
@@ -0,0 +1,144 @@
+/*
+ *  gro.c
+ *
+ *  ptrtd - Portable IPv6 TRT implementation
+ *
+ *  Copyright (C) 2001  Nathan Lutchansky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+#include "defs.h"
+#include "util.h"
+#include "tcp.h"
+#include "gro.h"
+
+/*
+ * Receive offload for TCP.  Within one read burst from the interface,
+ * in-order data segments of the same connection are glued into one
+ * bigger segment before handle_tcp sees them, so the tcb lookup, the
+ * buffer write, the app callback and the ACK happen once per burst
+ * instead of once per segment.
+ *
+ * Only plain ACK (and ACK+PSH) segments carrying data are merged, and
+ * only while the IPv6 traffic class, the TCP header length and the
+ * options match, so no ECN mark, option or control flag is lost.  A
+ * PSH ends a merge.  Anything else for a connection being merged
+ * first flushes what has been gathered, to keep the order.
+ */
+
+#define GRO_FLOWS	8
+#define GRO_MAX		65535	/* IPv6 payload length limit */
+
+struct gro_ctx
+{
+	uchar *buf;		/* headers of the first segment, then the payload */
+	int len;		/* 0 when the context is free */
+	int hlen;
+	uint next_seq;
+	int segs;
+};
+
+static struct gro_ctx ctx[GRO_FLOWS];
+static int next_victim = 0;
+
+static void
+gro_deliver (struct gro_ctx *c)
+{
+	if (!c->len)
+		return;
+	PUT_16 (c->buf + 4, c->len - 40);
+	handle_tcp (c->buf, c->len);
+	c->len = 0;
+}
+
+// addresses and ports
+static int
+gro_same_flow (struct gro_ctx *c, uchar const *p)
+{
+	return !memcmp (c->buf + 8, p + 8, 36);
+}
+
+void
+gro_receive (uchar * p, int len)
+{
+	struct gro_ctx *c, *slot = NULL;
+	int i, hlen, dlen, flags;
+
+	hlen = 40 + 4 * (p[52] >> 4);
+	dlen = len - hlen;
+	flags = p[53];
+
+	for (i = 0; i < GRO_FLOWS; ++i) {
+		c = &ctx[i];
+		if (!c->len) {
+			if (!slot)
+				slot = c;
+			continue;
+		}
+		if (!gro_same_flow (c, p))
+			continue;
+		if ((flags & ~0x08) == 0x10 && dlen > 0 && hlen == c->hlen && GET_32 (p + 44) == c->next_seq
+		    && c->len + dlen - 40 <= GRO_MAX && !memcmp (c->buf, p, 4) && !memcmp (c->buf + 60, p + 60, hlen - 60)) {
+			memcpy (c->buf + c->len, p + hlen, dlen);
+			c->len += dlen;
+			c->next_seq += dlen;
+			++c->segs;
+			memcpy (c->buf + 48, p + 48, 4);	// latest ack
+			memcpy (c->buf + 54, p + 54, 2);	// and window
+			if (flags & 0x08) {
+				c->buf[53] |= 0x08;
+				gro_deliver (c);
+			}
+			return;
+		}
+		gro_deliver (c);
+		slot = c;
+		break;
+	}
+
+	if ((flags & ~0x08) != 0x10 || dlen <= 0 || (flags & 0x08)) {
+		handle_tcp (p, len);
+		return;
+	}
+
+	if (!slot) {
+		slot = &ctx[next_victim];
+		next_victim = (next_victim + 1) % GRO_FLOWS;
+		gro_deliver (slot);
+	}
+	if (!slot->buf)
+		slot->buf = ALLOC (GRO_MAX + 40 + 1);	// +1: handle_tcp's trace NUL
+	memcpy (slot->buf, p, len);
+	slot->len = len;
+	slot->hlen = hlen;
+	slot->next_seq = GET_32 (p + 44) + dlen;
+	slot->segs = 1;
+}
+
+void
+gro_flush (void)
+{
+	int i;
+
+	for (i = 0; i < GRO_FLOWS; ++i)
+		gro_deliver (&ctx[i]);
+}
@@ -15,10 +15,15 @@
 #include "util.h"
 #include "http_status.h"
 #include "tcb.h"
+#include "timewait.h"
+#include "nat64.h"
+#include "udp.h"
 #include "config.h"
 
 static int update_count = 0;
 
+int dns64_count (void);
+
 static void
 setnoblock (int fd)
 {
@@ -56,7 +61,7 @@ write_status_report (int sock)
 {
 	char buffer[4000] = { "" };
 	int connection_count = 0, rc, fd;
-	struct tcb const *tcb = (struct tcb const *) rb_first (&tcblist);
+	struct tcb const *tcb = tcb_first ();
 	struct linger const linger = { 1, 5 };
 
 	fd = accept (sock, 0, 0);
@@ -75,9 +80,8 @@ write_status_report (int sock)
 			  "<td>Local Port</td>\n" "<td>Packets</td>\n"
 			  "<td>inbuf</td>\n" "<td>outbuf</td>\n" "<td>State</td>\n" "<td>Start Time</td>\n" "</tr>\n");
 		rc = write (fd, buffer, strlen (buffer));
-		/* The last one in the list is the sentinal */
 		while (tcb) {
-			time_t const start_time = tcb->start_time.tv_sec;
+			time_t const start_time = tcb->cold->start_time.tv_sec;
 			char raddr[INET6_ADDRSTRLEN] = { "Unknown" };
 			char laddr4[INET6_ADDRSTRLEN] = { "Unknown" };
 
@@ -95,22 +99,23 @@ write_status_report (int sock)
 				  "<td>%s</td>\n"
 				  "<td>%s</td>\n"
 				  "</tr>\n", raddr, tcb->rport, laddr4,
-				  tcb->lport, tcb->packets, tcb->inbuf
-				  && tcb->inbuf->p ? rb_left (tcb->inbuf) : -1,
-				  tcb->outbuf && tcb->outbuf->p ? rb_left (tcb->outbuf) : -1, stname[tcb->state], ctime (&start_time));
+				  tcb->lport, tcb->packets, tcb->inbuf ? rb_left (tcb->inbuf) : -1,
+				  tcb->outbuf ? rb_left (tcb->outbuf) : -1, stname[tcb->state], ctime (&start_time));
 			rc = write (fd, buffer, strlen (buffer));
 
 			++connection_count;
-			tcb = (struct tcb const *) rb_next ((struct rb_node const *) tcb);
+			tcb = tcb_next (tcb);
 		}
 
 
-		snprintf (buffer, sizeof (buffer), "</table>\n" "<p>Total Connections: %d</p><hr/>\n"
+		snprintf (buffer, sizeof (buffer), "</table>\n" "<p>Total Connections: %d</p>\n" "<p>TIME_WAIT: %d</p>\n" "<p>NAT64 sessions: %d</p>\n" "<p>DNS64 cached names: %d</p>\n" "<p>UDP queue drops: %d</p>\n"
+			  "<p>Buffered: %lldk of %dk budget, %lldk reserved</p><hr/>\n"
 			  "<p>IPv4 Network Prefix:  %x:%x:%x:%x::/%d</p>" "<p>Current Time: %s</p>\n"
 #ifdef TRACK_MEMORY
 			  "<p>Heap Memory in use: %dk</p>\n"
 #endif
-			  "<p>%s: %s</p>\n"  "<p>PID: %ld</p>" "<p>Status Updates: %d</p>\n" "</body>\n</html>\n", connection_count,
+			  "<p>%s: %s</p>\n"  "<p>PID: %ld</p>" "<p>Status Updates: %d</p>\n" "</body>\n</html>\n", connection_count, tw_count (), nat64_count (), dns64_count (), udp_flow_drops (),
+			  rb_bytes_used / 1024, globals.buffer_budget, rb_bytes_reserved / 1024,
 			  ntohs (globals.prefix[0]),
 			  ntohs (globals.prefix[1]),
 			  ntohs (globals.prefix[2]), ntohs (globals.prefix[3]), globals.plen, ctime (&current_time),
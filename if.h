@@ -34,6 +34,13 @@ struct iface
 	struct pbuf *(*get_buffer) (struct iface * iface, int size);
 	int (*send_unicast) (struct iface * iface, struct pbuf * pb, uchar * hwdest);
 	int (*send_multicast) (struct iface * iface, struct pbuf * pb, uchar * dest);
+	/* send a packet without taking it over, NULL if the driver can't */
+	int (*forward) (struct iface * iface, struct pbuf * pb);
+
+	/* drivers that hand over a whole read burst before calling
+	 * batch_end (if the owner set it) say so in batch */
+	int batch;
+	void (*batch_end) (struct iface * iface);
 };
 
 int register_iface_driver (char *name, struct iface *(*create_func) (char *arg, void (*handle_pkt)
@@ -97,18 +97,20 @@ get_tun (char *dev, char *reqdev, int tap)
 }
 #endif
 
-/* called by tun/tap_read_callback */
+/* called by tun/tap_read_callback; 1 means nothing left to read */
 static int
-tuntap_do_read (int fd, struct pbuf *p)
+tuntap_do_read (int fd, struct pbuf *p, int proto)
 {
 	p->dlen = read (fd, p->d, p->max);
+	if (p->dlen < 0 && errno == EAGAIN)
+		return 1;
 	if (p->dlen < 0) {
 		perror ("read from tun");
 		exit (1);
 	}
 	// does 0 mean the interface died?
 #ifdef HAVE_LINUX_IF_TUN_H
-	if (p->dlen > 4 && GET_16 (p->d + 2) == ETH_P_IPV6) {
+	if (p->dlen > 4 && GET_16 (p->d + 2) == proto) {
 		pbuf_drop (p, 4);
 		return 0;
 	}
@@ -122,12 +124,13 @@ tuntap_do_read (int fd, struct pbuf *p)
 
 /* called by tun/tap_send routines */
 static int
-tuntap_do_send (int fd, struct pbuf *p)
+tuntap_do_send (int fd, struct pbuf *p, int proto)
 {
 #ifdef HAVE_LINUX_IF_TUN_H
-	pbuf_raise (p, 4);
+	if (pbuf_raise (p, 4) < 0)
+		return -1;
 	p->d[0] = p->d[1] = 0;
-	PUT_16 (p->d + 2, ETH_P_IPV6);
+	PUT_16 (p->d + 2, proto);
 #endif
 	return write (fd, p->d, p->dlen) < 0 ? -1 : 0;
 }
@@ -141,25 +144,36 @@ struct iface_tun
 	struct iface iface;
 	void (*pkt_handler) (struct iface * iface, struct pbuf * pkt);
 	int fd;
+	int proto;		/* ETH_P_IPV6, or ETH_P_IP for tun4 */
 	char devname[256];
 };
 
+#define TUN_BATCH	64	/* packets read per wakeup */
+
 /* called from read event created by tun_new_if */
 static int
 tun_read_callback (struct event *e, void *d)
 {
 	struct iface_tun *iface = (struct iface_tun *) d;
 	struct pbuf *pkt;
+	int i, ret;
 
+	for (i = 0; i < TUN_BATCH; ++i) {
 #ifdef HAVE_LINUX_IF_TUN_H
-	pkt = pbuf_new (iface->iface.mtu + 4);
+		pkt = pbuf_new (PBUF_HEADROOM + iface->iface.mtu + 4);
 #else
-	pkt = pbuf_new (iface->iface.mtu);
+		pkt = pbuf_new (PBUF_HEADROOM + iface->iface.mtu);
 #endif
-	if (tuntap_do_read (iface->fd, pkt) == 0) {
-		(*iface->pkt_handler) ((struct iface *) iface, pkt);
+		pbuf_drop (pkt, PBUF_HEADROOM);
+		if ((ret = tuntap_do_read (iface->fd, pkt, iface->proto)) == 0) {
+			(*iface->pkt_handler) ((struct iface *) iface, pkt);
+		}
+		pbuf_delete (pkt);
+		if (ret > 0)
+			break;
 	}
-	pbuf_delete (pkt);
+	if (iface->iface.batch_end)
+		(*iface->iface.batch_end) ((struct iface *) iface);
 	return 1;
 }
 
@@ -180,14 +194,20 @@ tun_send (struct iface *iface, struct pbuf *p, uchar * d)
 {
 	int ret;
 
-	ret = tuntap_do_send (((struct iface_tun *) iface)->fd, p);
+	ret = tuntap_do_send (((struct iface_tun *) iface)->fd, p, ((struct iface_tun *) iface)->proto);
 	pbuf_delete (p);
 	return ret;
 }
 
-/* called directly from iface driver registry */
-struct iface *
-tun_new_if (char *dev, void (*handle_pkt) (struct iface * iface, struct pbuf * pkt))
+/* called by main code via pointer in struct iface */
+static int
+tun_forward (struct iface *iface, struct pbuf *p)
+{
+	return tuntap_do_send (((struct iface_tun *) iface)->fd, p, ((struct iface_tun *) iface)->proto);
+}
+
+static struct iface *
+tun_create (char *dev, void (*handle_pkt) (struct iface * iface, struct pbuf * pkt), int proto)
 {
 	struct iface_tun *iface;
 
@@ -200,16 +220,34 @@ tun_new_if (char *dev, void (*handle_pkt) (struct iface * iface, struct pbuf * p
 	iface->fd = get_tun (iface->devname, dev, 0);
 	fcntl (iface->fd, F_SETFL, O_NONBLOCK);
 	iface->pkt_handler = handle_pkt;
+	iface->proto = proto;
 	iface->iface.mtu = 1280;
 	iface->iface.hwaddr_len = 0;
 	iface->iface.get_buffer = tun_get_buf;
 	iface->iface.send_unicast = tun_send;
 	iface->iface.send_multicast = tun_send;
+	iface->iface.forward = tun_forward;
+	iface->iface.batch = 1;
+	iface->iface.batch_end = NULL;
 	add_fd_event (iface->fd, 0, tun_read_callback, iface);
 
 	return (struct iface *) iface;
 }
 
+/* called directly from iface driver registry */
+struct iface *
+tun_new_if (char *dev, void (*handle_pkt) (struct iface * iface, struct pbuf * pkt))
+{
+	return tun_create (dev, handle_pkt, ETH_P_IPV6);
+}
+
+/* called directly from iface driver registry; carries IPv4 for the translator */
+struct iface *
+tun4_new_if (char *dev, void (*handle_pkt) (struct iface * iface, struct pbuf * pkt))
+{
+	return tun_create (dev, handle_pkt, ETH_P_IP);
+}
+
 /* called directly from main code */
 void
 tun_get_name (struct iface *iface, char *name)
@@ -239,8 +277,8 @@ tap_read_callback (struct event *e, void *d)
 
 	p = pbuf_new (iface->ife.iface.mtu + iface->ife.head_size);
 	pbuf_drop (p, iface->ife.head_size - 14);
-	tuntap_do_read (iface->fd, p);
-	iface->ife.recv_frame (&iface->ife, p);
+	if (tuntap_do_read (iface->fd, p, ETH_P_IPV6) <= 0)
+		iface->ife.recv_frame (&iface->ife, p);
 	pbuf_delete (p);
 	return 1;
 }
@@ -249,7 +287,7 @@ tap_read_callback (struct event *e, void *d)
 static int
 tap_send_frame (struct iface_ether *iface, struct pbuf *p)
 {
-	return tuntap_do_send (((struct iface_tap *) iface)->fd, p);
+	return tuntap_do_send (((struct iface_tap *) iface)->fd, p, ETH_P_IPV6);
 }
 
 /* called directly from main code */
@@ -288,5 +326,6 @@ tuntap_register (void)
 {
 	register_iface_driver ("tun", tun_new_if);
 	register_iface_driver ("tap", tap_new_if);
+	register_iface_driver ("tun4", tun4_new_if);
 	return 0;
 }
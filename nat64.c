@@ -0,0 +1,512 @@
+/*
+ *  nat64.c
+ *
+ *  ptrtd - Portable IPv6 TRT implementation
+ *
+ *  Copyright (C) 2001  Nathan Lutchansky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "defs.h"
+#include "util.h"
+#include "event.h"
+#include "xlat.h"
+#include "nat64.h"
+
+/*
+ * Stateful NAT64 (RFC 6146) at the packet level.  An IPv6 host talking
+ * to a prefixed address gets a binding (BIB entry) from its transport
+ * address to an address and port of the IPv4 pool, and one session per
+ * IPv4 peer under that binding.  Packets are rewritten in place: the
+ * port (or ICMP echo id) is swapped with an incremental checksum fix,
+ * then the headers go through the stateless translator with the pool
+ * address as one end.
+ *
+ * Mapping is endpoint-independent and paired (one IPv6 host always gets
+ * the same pool address); filtering is address- and port-dependent, so
+ * only peers with a session may reach in.  Sessions of a timeout class
+ * share one lifetime, which keeps each class list in expiry order and
+ * lets a once-a-second sweep pop expired ones off the heads.  At most
+ * nat64_sessions sessions exist; packets that would open another are
+ * dropped.
+ *
+ * ICMPv4 errors about a packet that left through a binding (the quoted
+ * packet's source is the pool address and port) go back to the IPv6
+ * host with the quoted packet mapped back too.
+ */
+
+#define NAT64_HASH	16384	/* buckets per BIB table, power of two */
+#define NAT64_PORT_MIN	1024
+
+#define NAT64_UDP	0	/* session timeout classes */
+#define NAT64_TCP_EST	1
+#define NAT64_TCP_TRANS	2
+#define NAT64_ICMP	3
+#define NAT64_CLASSES	4
+
+/* seconds, RFC 6146 section 4 */
+static int const nat64_timeout[NAT64_CLASSES] = { 300, 7440, 240, 60 };
+
+#define S_SYN6		0x01	/* TCP flags seen on a session */
+#define S_SYN4		0x02
+#define S_FIN6		0x04
+#define S_FIN4		0x08
+#define S_RST		0x10
+
+struct nat64_session;
+
+struct nat64_bib
+{
+	struct nat64_bib *next6;	/* hash chains */
+	struct nat64_bib *next4;
+	struct nat64_session *sessions;
+	uchar addr6[16];
+	uchar addr4[4];
+	unsigned short port6;
+	unsigned short port4;
+	uchar proto;
+};
+
+struct nat64_session
+{
+	struct nat64_session *next;	/* under the same binding */
+	struct nat64_session *lnext;	/* class list, oldest first */
+	struct nat64_session *lprev;
+	struct nat64_bib *bib;
+	uchar raddr4[4];
+	unsigned short rport;
+	uchar class;
+	uchar flags;
+	uint expire;		/* time_t, truncated */
+};
+
+static struct nat64_bib *bib6[NAT64_HASH];
+static struct nat64_bib *bib4[NAT64_HASH];
+static struct nat64_session *lhead[NAT64_CLASSES];
+static struct nat64_session *ltail[NAT64_CLASSES];
+static uchar nat64_key[16];
+static int keyed = 0;
+static int num_sessions = 0;
+static struct event *e_sweep = NULL;
+
+static uint
+hash6 (int proto, uchar const *addr6, int port)
+{
+	uchar k[19];
+
+	memcpy (k, addr6, 16);
+	PUT_16 (k + 16, port);
+	k[18] = proto;
+	return (uint) siphash (nat64_key, k, sizeof (k)) & (NAT64_HASH - 1);
+}
+
+static uint
+hash4 (int proto, uchar const *addr4, int port)
+{
+	uchar k[7];
+
+	memcpy (k, addr4, 4);
+	PUT_16 (k + 4, port);
+	k[6] = proto;
+	return (uint) siphash (nat64_key, k, sizeof (k)) & (NAT64_HASH - 1);
+}
+
+static struct nat64_bib *
+find6 (int proto, uchar const *addr6, int port)
+{
+	struct nat64_bib *b;
+
+	for (b = bib6[hash6 (proto, addr6, port)]; b; b = b->next6)
+		if (b->port6 == port && b->proto == proto && !memcmp (b->addr6, addr6, 16))
+			return b;
+	return NULL;
+}
+
+static struct nat64_bib *
+find4 (int proto, uchar const *addr4, int port)
+{
+	struct nat64_bib *b;
+
+	for (b = bib4[hash4 (proto, addr4, port)]; b; b = b->next4)
+		if (b->port4 == port && b->proto == proto && !memcmp (b->addr4, addr4, 4))
+			return b;
+	return NULL;
+}
+
+int
+nat64_owns (uchar const *addr4)
+{
+	uint a = GET_32 (addr4), pool = GET_32 (globals.pool4);
+	int shift = 32 - globals.pool4_len;
+
+	if (globals.pool4_len <= 0)
+		return 0;
+	return (a >> shift) == (pool >> shift);
+}
+
+/* a pool address and free port for a new binding, -1 if the address is full */
+static int
+bib_alloc (int proto, uchar const *addr6, int port6, uchar * addr4)
+{
+	uint pool = GET_32 (globals.pool4), size, port, span, i;
+	uchar k[16];
+
+	size = globals.pool4_len > 0 ? 1u << (32 - globals.pool4_len) : 1;
+	memcpy (k, addr6, 16);
+	PUT_32 (addr4, (pool & ~(size - 1)) + (uint) (siphash (nat64_key, k, 16) % size));
+
+	if (port6 >= NAT64_PORT_MIN && !find4 (proto, addr4, port6))
+		return port6;
+
+	span = 65536 - NAT64_PORT_MIN;
+	port = hash6 (proto, addr6, port6) % span;
+	for (i = 0; i < span; ++i, port = (port + 1) % span)
+		if (!find4 (proto, addr4, port + NAT64_PORT_MIN))
+			return port + NAT64_PORT_MIN;
+	return -1;
+}
+
+static struct nat64_bib *
+bib_new (int proto, uchar const *addr6, int port6)
+{
+	struct nat64_bib *b;
+	uchar addr4[4];
+	int port4;
+	uint h;
+
+	if ((port4 = bib_alloc (proto, addr6, port6, addr4)) < 0)
+		return NULL;
+
+	b = ALLOC (sizeof (struct nat64_bib));
+	memcpy (b->addr6, addr6, 16);
+	memcpy (b->addr4, addr4, 4);
+	b->port6 = port6;
+	b->port4 = port4;
+	b->proto = proto;
+	b->sessions = NULL;
+
+	h = hash6 (proto, addr6, port6);
+	b->next6 = bib6[h];
+	bib6[h] = b;
+	h = hash4 (proto, addr4, port4);
+	b->next4 = bib4[h];
+	bib4[h] = b;
+	return b;
+}
+
+static void
+bib_free (struct nat64_bib *b)
+{
+	struct nat64_bib **pp;
+
+	for (pp = bib6 + hash6 (b->proto, b->addr6, b->port6); *pp != b; pp = &(*pp)->next6);
+	*pp = b->next6;
+	for (pp = bib4 + hash4 (b->proto, b->addr4, b->port4); *pp != b; pp = &(*pp)->next4);
+	*pp = b->next4;
+	FREE (b);
+}
+
+static void
+list_unlink (struct nat64_session *s)
+{
+	if (s->lprev)
+		s->lprev->lnext = s->lnext;
+	else
+		lhead[s->class] = s->lnext;
+	if (s->lnext)
+		s->lnext->lprev = s->lprev;
+	else
+		ltail[s->class] = s->lprev;
+}
+
+static void
+session_free (struct nat64_session *s)
+{
+	struct nat64_bib *b = s->bib;
+	struct nat64_session **pp;
+
+	list_unlink (s);
+	for (pp = &b->sessions; *pp != s; pp = &(*pp)->next);
+	*pp = s->next;
+	if (!b->sessions)
+		bib_free (b);
+	FREE (s);
+	--num_sessions;
+}
+
+static int
+sweep (struct event *e, void *d)
+{
+	uint now = time (NULL);
+	time_ref tr;
+	int c;
+
+	for (c = 0; c < NAT64_CLASSES; ++c)
+		while (lhead[c] && (int) (lhead[c]->expire - now) <= 0)
+			session_free (lhead[c]);
+
+	if (!num_sessions) {
+		e_sweep = NULL;
+		return 0;
+	}
+	time_future (&tr, 1000);
+	resched_time_event (e, &tr);
+	return 1;
+}
+
+/* note the packet's flags, then move the session to the tail of its class */
+static void
+session_touch (struct nat64_session *s, uchar const *tcp, int from6)
+{
+	int class = s->class;
+	time_ref tr;
+
+	if (tcp) {
+		if (tcp[13] & 0x04)
+			s->flags |= S_RST;
+		if (tcp[13] & 0x02)
+			s->flags |= from6 ? S_SYN6 : S_SYN4;
+		if (tcp[13] & 0x01)
+			s->flags |= from6 ? S_FIN6 : S_FIN4;
+		if ((s->flags & S_RST) || (s->flags & (S_FIN6 | S_FIN4)) == (S_FIN6 | S_FIN4)
+		    || (s->flags & (S_SYN6 | S_SYN4)) != (S_SYN6 | S_SYN4))
+			class = NAT64_TCP_TRANS;
+		else
+			class = NAT64_TCP_EST;
+	}
+
+	if (s->lnext || s->lprev || lhead[s->class] == s)
+		list_unlink (s);
+	s->class = class;
+	s->expire = time (NULL) + nat64_timeout[class];
+	s->lnext = NULL;
+	s->lprev = ltail[class];
+	if (s->lprev)
+		s->lprev->lnext = s;
+	else
+		lhead[class] = s;
+	ltail[class] = s;
+
+	if (!e_sweep) {
+		time_future (&tr, 1000);
+		e_sweep = add_time_event (&tr, sweep, NULL);
+	}
+}
+
+static struct nat64_session *
+session_find (struct nat64_bib *b, uchar const *raddr4, int rport)
+{
+	struct nat64_session *s;
+
+	for (s = b->sessions; s; s = s->next)
+		if (s->rport == rport && !memcmp (s->raddr4, raddr4, 4))
+			return s;
+	return NULL;
+}
+
+static struct nat64_session *
+session_new (struct nat64_bib *b, uchar const *raddr4, int rport)
+{
+	struct nat64_session *s;
+
+	s = ALLOC (sizeof (struct nat64_session));
+	s->bib = b;
+	memcpy (s->raddr4, raddr4, 4);
+	s->rport = rport;
+	s->class = b->proto == 6 ? NAT64_TCP_TRANS : b->proto == 17 ? NAT64_UDP : NAT64_ICMP;
+	s->flags = 0;
+	s->lnext = s->lprev = NULL;
+	s->next = b->sessions;
+	b->sessions = s;
+	++num_sessions;
+	return s;
+}
+
+/*
+ * Where the identifying port sits for a proto: the source port of TCP/UDP,
+ * the echo id for ICMP; the peer's port is the other one (0 for ICMP).
+ * Returns the checksum offset, or -1 when the packet isn't translatable.
+ */
+static int
+l4_layout (int proto, uchar const *l4, int plen, int *sport, int *dport)
+{
+	switch (proto) {
+	case 6:
+		if (plen < 20)
+			return -1;
+		*sport = 0;
+		*dport = 2;
+		return 16;
+	case 17:
+		if (plen < 8)
+			return -1;
+		*sport = 0;
+		*dport = 2;
+		return 6;
+	default:
+		if (plen < 8)
+			return -1;
+		*sport = *dport = 4;
+		return 2;
+	}
+}
+
+int
+nat64_6to4 (struct pbuf *p)
+{
+	struct nat64_bib *b;
+	struct nat64_session *s;
+	uchar *d = p->d, *l4 = p->d + 40, port[2];
+	int proto, plen, ck, sp, dp, rport;
+
+	if (p->dlen < 40 || memcmp (d + 24, globals.prefix, 12) || globals.pool4_len <= 0)
+		return XLAT_PASS;
+	proto = d[6];
+	plen = GET_16 (d + 4);
+	if (proto == 58 && (plen < 8 || l4[0] != 128))
+		return XLAT_PASS;	// only echo requests start a mapping
+	if (proto != 6 && proto != 17 && proto != 58)
+		return XLAT_PASS;
+	if (plen + 40 > p->dlen || (ck = l4_layout (proto, l4, plen, &sp, &dp)) < 0)
+		return XLAT_DROP;
+	if (!keyed) {
+		random_bytes (nat64_key, sizeof (nat64_key));
+		keyed = 1;
+	}
+
+	rport = proto == 58 ? 0 : GET_16 (l4 + dp);
+	b = find6 (proto, d + 8, GET_16 (l4 + sp));
+	if (!(s = b ? session_find (b, d + 36, rport) : NULL) && num_sessions >= globals.nat64_sessions)
+		return XLAT_DROP;
+	if (!b) {
+		// a TCP mapping is only set up by a SYN
+		if (proto == 6 && !(l4[13] & 0x02))
+			return XLAT_DROP;
+		if (!(b = bib_new (proto, d + 8, GET_16 (l4 + sp))))
+			return XLAT_DROP;
+	}
+	if (!s)
+		s = session_new (b, d + 36, rport);
+	session_touch (s, proto == 6 ? l4 : NULL, 1);
+
+	PUT_16 (port, b->port4);
+	if (proto != 58)
+		xlat_cksum_update (l4 + ck, l4 + sp, port, 2);
+	memcpy (l4 + sp, port, 2);
+	return xlat_6to4_addr (p, b->addr4, d + 36);
+}
+
+/*
+ * An ICMPv4 error (xlat_icmp_error gave its offset ihl) about a packet
+ * sent through a binding: put the binding's IPv6 port back into the
+ * quoted packet, then translate toward the IPv6 host.
+ */
+static int
+nat64_icmp_error (struct pbuf *p, int ihl)
+{
+	struct nat64_bib *b;
+	uchar *d = p->d, *inner = p->d + ihl + 8, *il4, src6[16], idst6[16], port[2];
+	int iproto, id, ck, rport;
+
+	iproto = inner[9];
+	il4 = inner + (inner[0] & 0xf) * 4;
+	if (memcmp (inner + 12, d + 16, 4))
+		return XLAT_DROP;	// we didn't send it
+	switch (iproto) {
+	case 6:
+	case 17:
+		id = 0;
+		rport = GET_16 (il4 + 2);
+		ck = iproto == 6 ? 16 : 6;
+		break;
+	case 1:
+		if (il4[0] != 8)
+			return XLAT_DROP;	// only echo requests have a binding
+		id = 4;
+		rport = 0;
+		ck = 2;
+		break;
+	default:
+		return XLAT_DROP;
+	}
+	if (!(b = find4 (iproto == 1 ? 58 : iproto, inner + 12, GET_16 (il4 + id))) || !session_find (b, inner + 16, rport))
+		return XLAT_DROP;
+
+	// only 8 bytes are sure to be quoted, so the checksum may be cut off
+	PUT_16 (port, b->port6);
+	if (il4 + ck + 2 <= d + GET_16 (d + 2) && (iproto != 17 || GET_16 (il4 + ck)))
+		xlat_cksum_update (il4 + ck, il4 + id, port, 2);
+	memcpy (il4 + id, port, 2);
+
+	memcpy (src6, globals.prefix, 12);
+	memcpy (src6 + 12, d + 12, 4);
+	memcpy (idst6, globals.prefix, 12);
+	memcpy (idst6 + 12, inner + 16, 4);
+	return xlat_icmp_4to6 (p, src6, b->addr6, b->addr6, idst6);
+}
+
+int
+nat64_4to6 (struct pbuf *p)
+{
+	struct nat64_bib *b;
+	struct nat64_session *s;
+	uchar *d = p->d, *l4, src6[16], port[2];
+	int ihl, proto, plen, ck, sp, dp, rport;
+
+	if (p->dlen < 20 || !nat64_owns (d + 16))
+		return XLAT_PASS;
+	ihl = (d[0] & 0xf) * 4;
+	proto = d[9];
+	plen = GET_16 (d + 2) - ihl;
+	l4 = d + ihl;
+	if (proto == 1 && xlat_icmp_error (p))
+		return nat64_icmp_error (p, ihl);
+	if (proto == 1 && (plen < 8 || l4[0] != 0))
+		return XLAT_DROP;	// echo replies only
+	if ((proto != 6 && proto != 17 && proto != 1) || ihl < 20 || plen < 0 || ihl + plen > p->dlen)
+		return XLAT_DROP;
+	if ((ck = l4_layout (proto, l4, plen, &sp, &dp)) < 0)
+		return XLAT_DROP;
+
+	rport = proto == 1 ? 0 : GET_16 (l4 + sp);
+	if (!(b = find4 (proto == 1 ? 58 : proto, d + 16, GET_16 (l4 + dp))))
+		return XLAT_DROP;
+	if (!(s = session_find (b, d + 12, rport)))
+		return XLAT_DROP;
+	session_touch (s, proto == 6 ? l4 : NULL, 0);
+
+	PUT_16 (port, b->port6);
+	if (proto == 6 || (proto == 17 && GET_16 (l4 + ck)))
+		xlat_cksum_update (l4 + ck, l4 + dp, port, 2);
+	memcpy (l4 + dp, port, 2);
+
+	memcpy (src6, globals.prefix, 12);
+	memcpy (src6 + 12, d + 12, 4);
+	return xlat_4to6_addr (p, src6, b->addr6);
+}
+
+int
+nat64_count (void)
+{
+	return num_sessions;
+}
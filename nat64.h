@@ -0,0 +1,34 @@
+/*
+ *  nat64.h
+ *
+ *  ptrtd - Portable IPv6 TRT implementation
+ *
+ *  Copyright (C) 2001  Nathan Lutchansky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NAT64_H
+#define _NAT64_H
+
+#include "pbuf.h"
+
+/* both return an XLAT_ code */
+int nat64_6to4 (struct pbuf *p);
+int nat64_4to6 (struct pbuf *p);
+int nat64_owns (uchar const *addr4);
+int nat64_count (void);
+
+#endif /* _NAT64_H */
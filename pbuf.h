@@ -35,6 +35,8 @@ struct pbuf
 	uchar buf[0];
 };
 
+#define PBUF_HEADROOM	64	/* kept ahead of received packets so a handler can grow the header in place */
+
 struct pbuf *pbuf_new (int size);
 void pbuf_delete (struct pbuf *pb);
 int pbuf_drop (struct pbuf *pb, int len);
@@ -0,0 +1,558 @@
+/*
+ *  ptrtd-dns64.c
+ *
+ *  ptrtd - Portable IPv6 TRT implementation
+ *
+ *  Copyright (C) 2001  Nathan Lutchansky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * DNS64 (RFC 6147).  With dns64 set to an IPv4 resolver, queries sent to
+ * that resolver's translated address (prefix::a.b.c.d, port 53) are caught
+ * here instead of going through the UDP mapper.  AAAA queries are asked
+ * upstream as-is first; a name without AAAA records is asked again for A
+ * and the answer is synthesized into the prefix.  Either way the addresses
+ * are kept in a cache bounded at dns64_cache names, dropped when their TTL
+ * runs out or least recently used first, so repeats are answered here
+ * without leaving the process.  Names without addresses are cached too,
+ * with their rcode and the SOA's negative TTL (RFC 2308).  Other query
+ * types are relayed untouched.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+
+#include "util.h"
+#include "config.h"
+#include "event.h"
+#include "defs.h"
+#include "udp.h"
+#include "srcpool.h"
+
+#define DNS_PORT	53
+#define DNS_MSG		512	/* UDP message without EDNS0 */
+#define DNS_HDR		12
+#define T_A		1
+#define T_SOA		6
+#define T_AAAA		28
+#define C_IN		1
+
+#define DNS64_HASH	1024
+#define DNS64_ADDRS	16	/* AAAA records kept per name */
+#define DNS64_MAX_TTL	86400
+#define DNS64_PENDING	1024	/* queries waiting on the upstream resolver */
+#define DNS64_TIMEOUT	5000	/* msec, then the client retries */
+
+struct dns64_entry
+{
+	struct dns64_entry *next;	/* hash chain */
+	struct dns64_entry *newer;	/* LRU list */
+	struct dns64_entry *older;
+	time_ref stored;
+	int ttl;
+	int rcode;		/* NXDOMAIN is cached with no addresses */
+	int naddr;
+	uchar addr[DNS64_ADDRS][16];
+	int nlen;
+	uchar name[256];	/* wire format, lower case */
+};
+
+struct dns64_query
+{
+	struct dns64_query *next;	/* hash chain by upstream id */
+	struct dns64_query *newer;	/* FIFO, oldest first */
+	struct dns64_query *older;
+	int id;			/* upstream */
+	int qtype;		/* type asked upstream, -1 = relay only */
+	time_ref start;
+	uchar laddr[16];
+	int lport;
+	uchar raddr[16];
+	int rport;
+	int qend;		/* end of the question */
+	int nlen;
+	uchar name[256];
+	int len;
+	uchar msg[DNS_MSG];	/* the client's query */
+};
+
+static struct dns64_entry *cache[DNS64_HASH];
+static struct dns64_entry *lru_head = NULL, *lru_tail = NULL;
+static int cached = 0;
+
+static struct dns64_query *pending[DNS64_HASH];
+static struct dns64_query *fifo_head = NULL, *fifo_tail = NULL;
+static int num_pending = 0;
+static struct event *e_expire = NULL;
+
+static uchar hash_key[16];
+static int upstream = -1;
+static struct udp_socket *listener = NULL;
+static struct udp_callback dns64_cb;
+
+static uint
+name_hash (uchar const *name, int nlen)
+{
+	return (uint) siphash (hash_key, name, nlen) & (DNS64_HASH - 1);
+}
+
+/*
+ * The question of a message: its name in lower case, type and where it
+ * ends.  Compression is not allowed there.  Returns -1 if malformed.
+ */
+static int
+parse_question (uchar const *m, int len, uchar * name, int *nlen, int *qtype)
+{
+	int off = DNS_HDR, n = 0, l;
+
+	if (len < DNS_HDR || GET_16 (m + 4) != 1)
+		return -1;
+	do {
+		if (off >= len || (l = m[off]) > 63 || n + l + 1 > 255 || off + l + 1 > len)
+			return -1;
+		name[n++] = l;
+		for (++off; l--; ++off)
+			name[n++] = tolower (m[off]);
+	} while (name[n - 1]);
+	if (off + 4 > len || GET_16 (m + off + 2) != C_IN)
+		return -1;
+	*nlen = n;
+	*qtype = GET_16 (m + off);
+	return off + 4;
+}
+
+static int
+skip_name (uchar const *m, int len, int off)
+{
+	while (off < len) {
+		if ((m[off] & 0xc0) == 0xc0)
+			return off + 2;
+		if (!m[off])
+			return off + 1;
+		off += m[off] + 1;
+	}
+	return -1;
+}
+
+/* a record's TTL, which RFC 2181 says to read as zero when the top bit is set */
+static int
+rr_ttl (uchar const *p)
+{
+	int t = GET_16 (p) << 16 | GET_16 (p + 2);
+
+	return t < 0 ? 0 : t;
+}
+
+/* records of the answer section of type qtype, into addr (16 bytes each) */
+static int
+parse_answers (uchar const *m, int len, int off, int qtype, uchar addr[][16], int *ttl)
+{
+	int i, n = 0, an = GET_16 (m + 6), rdlen, t;
+
+	*ttl = DNS64_MAX_TTL;
+	for (i = 0; i < an; ++i) {
+		if ((off = skip_name (m, len, off)) < 0 || off + 10 > len)
+			return n;
+		rdlen = GET_16 (m + off + 8);
+		if (off + 10 + rdlen > len)
+			return n;
+		if (GET_16 (m + off) == qtype && GET_16 (m + off + 2) == C_IN && rdlen == (qtype == T_A ? 4 : 16) && n < DNS64_ADDRS) {
+			if (qtype == T_A) {
+				memcpy (addr[n], globals.prefix, 12);
+				memcpy (addr[n] + 12, m + off + 10, 4);
+			} else
+				memcpy (addr[n], m + off + 10, 16);
+			++n;
+			if ((t = rr_ttl (m + off + 4)) < *ttl)
+				*ttl = t;
+		}
+		off += 10 + rdlen;
+	}
+	return n;
+}
+
+/*
+ * How long an answer without addresses may be cached: the SOA of the
+ * authority section, the lower of its TTL and MINIMUM.  0 without one.
+ */
+static int
+negative_ttl (uchar const *m, int len, int off)
+{
+	int i, rdlen, ttl, min, n = GET_16 (m + 6) + GET_16 (m + 8);
+
+	for (i = 0; i < n; ++i) {
+		if ((off = skip_name (m, len, off)) < 0 || off + 10 > len)
+			return 0;
+		rdlen = GET_16 (m + off + 8);
+		if (off + 10 + rdlen > len)
+			return 0;
+		if (i >= GET_16 (m + 6) && GET_16 (m + off) == T_SOA && rdlen >= 22) {
+			ttl = rr_ttl (m + off + 4);
+			min = rr_ttl (m + off + 10 + rdlen - 4);
+			ttl = min < ttl ? min : ttl;
+			return ttl < DNS64_MAX_TTL ? ttl : DNS64_MAX_TTL;
+		}
+		off += 10 + rdlen;
+	}
+	return 0;
+}
+
+static void
+lru_unlink (struct dns64_entry *e)
+{
+	if (e->newer)
+		e->newer->older = e->older;
+	else
+		lru_head = e->older;
+	if (e->older)
+		e->older->newer = e->newer;
+	else
+		lru_tail = e->newer;
+}
+
+static void
+lru_push (struct dns64_entry *e)
+{
+	e->newer = NULL;
+	e->older = lru_head;
+	if (lru_head)
+		lru_head->newer = e;
+	else
+		lru_tail = e;
+	lru_head = e;
+}
+
+static void
+cache_remove (struct dns64_entry *e)
+{
+	struct dns64_entry **pp;
+
+	for (pp = cache + name_hash (e->name, e->nlen); *pp != e; pp = &(*pp)->next);
+	*pp = e->next;
+	lru_unlink (e);
+	--cached;
+	FREE (e);
+}
+
+/* seconds e has left, 0 once it has expired */
+static int
+ttl_left (struct dns64_entry *e)
+{
+	int left = e->ttl - time_ago (&e->stored) / 1000;
+
+	return left > 0 ? left : 0;
+}
+
+static struct dns64_entry *
+cache_find (uchar const *name, int nlen)
+{
+	struct dns64_entry *e;
+
+	for (e = cache[name_hash (name, nlen)]; e; e = e->next)
+		if (e->nlen == nlen && !memcmp (e->name, name, nlen))
+			break;
+	if (!e)
+		return NULL;
+	if (!ttl_left (e)) {
+		cache_remove (e);
+		return NULL;
+	}
+	lru_unlink (e);
+	lru_push (e);
+	return e;
+}
+
+static struct dns64_entry *
+cache_store (uchar const *name, int nlen, uchar addr[][16], int naddr, int ttl, int rcode)
+{
+	struct dns64_entry *e;
+	uint h;
+
+	if (globals.dns64_cache <= 0 || ttl <= 0)
+		return NULL;
+	if (!(e = cache_find (name, nlen))) {
+		while (cached >= globals.dns64_cache)
+			cache_remove (lru_tail);
+		e = ALLOC (sizeof (struct dns64_entry));
+		memcpy (e->name, name, nlen);
+		e->nlen = nlen;
+		h = name_hash (name, nlen);
+		e->next = cache[h];
+		cache[h] = e;
+		lru_push (e);
+		++cached;
+	}
+	time_now (&e->stored);
+	e->ttl = ttl;
+	e->rcode = rcode;
+	e->naddr = naddr;
+	memcpy (e->addr, addr, naddr * 16);
+	return e;
+}
+
+/*
+ * An answer to the AAAA question in q (qend bytes of the client's query),
+ * with id and the RD bit taken from it.  The records stop short of
+ * DNS_MSG.  Returns the message length.
+ */
+static int
+build_answer (uchar * m, uchar const *q, int qend, uchar addr[][16], int naddr, int ttl, int rcode)
+{
+	int i, off;
+
+	memcpy (m, q, qend);
+	m[2] = 0x80 | (q[2] & 0x01);	// QR, RD
+	m[3] = 0x80 | rcode;	// RA
+	PUT_16 (m + 6, 0);
+	PUT_16 (m + 8, 0);
+	PUT_16 (m + 10, 0);
+	for (i = 0, off = qend; i < naddr && off + 28 <= DNS_MSG; ++i, off += 28) {
+		PUT_16 (m + off, 0xc000 | DNS_HDR);
+		PUT_16 (m + off + 2, T_AAAA);
+		PUT_16 (m + off + 4, C_IN);
+		PUT_32 (m + off + 6, ttl);
+		PUT_16 (m + off + 10, 16);
+		memcpy (m + off + 12, addr[i], 16);
+	}
+	PUT_16 (m + 6, i);
+	return off;
+}
+
+static void
+reply (struct dns64_query *q, uchar * m, int len)
+{
+	udp_send (listener, m, len, q->laddr, q->lport, q->raddr, q->rport);
+}
+
+static struct dns64_query *
+find_query (int id)
+{
+	struct dns64_query *q;
+
+	for (q = pending[id & (DNS64_HASH - 1)]; q; q = q->next)
+		if (q->id == id)
+			break;
+	return q;
+}
+
+/* done with q, answered or not */
+static void
+forget_query (struct dns64_query *q)
+{
+	struct dns64_query **pp;
+
+	for (pp = pending + (q->id & (DNS64_HASH - 1)); *pp != q; pp = &(*pp)->next);
+	*pp = q->next;
+	if (q->newer)
+		q->newer->older = q->older;
+	else
+		fifo_tail = q->older;
+	if (q->older)
+		q->older->newer = q->newer;
+	else
+		fifo_head = q->newer;
+	--num_pending;
+	FREE (q);
+}
+
+static int
+expire_queries (struct event *e, void *d)
+{
+	struct dns64_query *q;
+	time_ref tr;
+
+	while ((q = fifo_head) && time_ago (&q->start) >= DNS64_TIMEOUT)
+		forget_query (q);
+	if (!fifo_head) {
+		e_expire = NULL;
+		return 0;
+	}
+	tr = fifo_head->start;
+	time_add (&tr, DNS64_TIMEOUT);
+	resched_time_event (e, &tr);
+	return 1;
+}
+
+/* ask the upstream resolver the client's question as qtype */
+static void
+ask (struct dns64_query *q, int qtype)
+{
+	uchar m[DNS_MSG];
+
+	memcpy (m, q->msg, q->len);
+	PUT_16 (m, q->id);
+	if (qtype >= 0)
+		PUT_16 (m + q->qend - 4, qtype);
+	q->qtype = qtype;
+	send (upstream, m, q->len, 0);
+}
+
+static void
+incoming (void *d, uchar * data, int len, uchar * laddr, int lport, uchar * raddr, int rport)
+{
+	struct dns64_query *q;
+	struct dns64_entry *e;
+	uchar m[DNS_MSG], name[256];
+	int qend, nlen, qtype, h, id;
+	time_ref tr;
+
+	if (len > DNS_MSG || (qend = parse_question (data, len, name, &nlen, &qtype)) < 0 || (data[2] & 0xf8))
+		return;		// not a standard query
+
+	if (qtype == T_AAAA && (e = cache_find (name, nlen))) {
+		len = build_answer (m, data, qend, e->addr, e->naddr, ttl_left (e), e->rcode);
+		udp_send (listener, m, len, laddr, lport, raddr, rport);
+		return;
+	}
+	if (num_pending >= DNS64_PENDING)
+		return;
+
+	q = ALLOC (sizeof (struct dns64_query));
+	do {
+		random_bytes (m, 2);
+		id = GET_16 (m);
+	} while (find_query (id));
+	q->id = id;
+	time_now (&q->start);
+	memcpy (q->laddr, laddr, 16);
+	q->lport = lport;
+	memcpy (q->raddr, raddr, 16);
+	q->rport = rport;
+	q->qend = qend;
+	memcpy (q->name, name, nlen);
+	q->nlen = nlen;
+	memcpy (q->msg, data, len);
+	q->len = len;
+	h = id & (DNS64_HASH - 1);
+	q->next = pending[h];
+	pending[h] = q;
+	q->newer = NULL;
+	q->older = fifo_tail;
+	if (fifo_tail)
+		fifo_tail->newer = q;
+	else
+		fifo_head = q;
+	fifo_tail = q;
+	++num_pending;
+	if (!e_expire) {
+		time_future (&tr, DNS64_TIMEOUT);
+		e_expire = add_time_event (&tr, expire_queries, NULL);
+	}
+
+	ask (q, qtype == T_AAAA ? T_AAAA : -1);
+}
+
+static void
+handle_response (uchar * m, int len)
+{
+	struct dns64_query *q;
+	uchar name[256], addr[DNS64_ADDRS][16], out[DNS_MSG];
+	int nlen, qtype, off, n, ttl = 0, rcode;
+
+	if (len < DNS_HDR || !(m[2] & 0x80) || !(q = find_query (GET_16 (m))))
+		return;
+	if ((off = parse_question (m, len, name, &nlen, &qtype)) < 0 || nlen != q->nlen || memcmp (name, q->name, nlen))
+		return;		// not the question we asked
+	if (q->qtype >= 0 && qtype != q->qtype)
+		return;
+	rcode = m[3] & 0x0f;
+
+	if (q->qtype == T_AAAA && (m[2] & 0x02))
+		;		// truncated, the client retries over TCP
+	else if (q->qtype == T_AAAA && !rcode) {
+		if (!(n = parse_answers (m, len, off, T_AAAA, addr, &ttl))) {
+			ask (q, T_A);	// no AAAA, synthesize from A
+			return;
+		}
+		cache_store (name, nlen, addr, n, ttl, 0);
+	} else if (q->qtype == T_AAAA && rcode == 3)
+		cache_store (name, nlen, addr, 0, negative_ttl (m, len, off), rcode);
+	else if (q->qtype == T_A) {
+		n = rcode ? 0 : parse_answers (m, len, off, T_A, addr, &ttl);
+		if (!n)
+			ttl = negative_ttl (m, len, off);
+		if (!rcode || rcode == 3)
+			cache_store (name, nlen, addr, n, ttl, rcode);
+		reply (q, out, build_answer (out, q->msg, q->qend, addr, n, n ? ttl : 0, rcode));
+		forget_query (q);
+		return;
+	}
+	// relay the upstream answer under the client's id
+	m[0] = q->msg[0];
+	m[1] = q->msg[1];
+	reply (q, m, len);
+	forget_query (q);
+}
+
+static int
+handle_upstream (struct event *e, void *d)
+{
+	static uchar m[65536];
+	int len;
+
+	while ((len = recv (upstream, m, sizeof (m), 0)) >= 0)
+		handle_response (m, len);
+	return 1;
+}
+
+void
+ptrtd_dns64_init (void)
+{
+	struct sockaddr_in sin;
+	uchar laddr[16];
+
+	if (!GET_32 (globals.dns64))
+		return;
+
+	random_bytes (hash_key, sizeof (hash_key));
+	if ((upstream = socket (AF_INET, SOCK_DGRAM, 0)) < 0) {
+		perror ("can't make DNS64 socket");
+		exit (1);
+	}
+	fcntl (upstream, F_SETFL, O_NONBLOCK);
+	if (srcpool_bind (upstream, globals.dns64, 4) < 0)
+		perror ("DNS64 source pool");
+	memset (&sin, 0, sizeof (sin));
+	sin.sin_family = AF_INET;
+	memcpy (&sin.sin_addr, globals.dns64, 4);
+	sin.sin_port = htons (DNS_PORT);
+	if (connect (upstream, (struct sockaddr *) &sin, sizeof (sin)) < 0) {
+		perror ("DNS64 upstream");
+		exit (1);
+	}
+	add_fd_event (upstream, 0, handle_upstream, NULL);
+
+	memcpy (laddr, globals.prefix, 12);
+	memcpy (laddr + 12, globals.dns64, 4);
+	dns64_cb.incoming_packet = incoming;
+	listener = udp_open (&dns64_cb, NULL, laddr, DNS_PORT);
+}
+
+int
+dns64_count (void)
+{
+	return cached;
+}
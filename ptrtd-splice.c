@@ -0,0 +1,361 @@
+/*
+ *  ptrtd-splice.c
+ *
+ *  ptrtd - Portable IPv6 TRT implementation
+ *
+ *  Copyright (C) 2001  Nathan Lutchansky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Kernel-terminated TCP.  With a TPROXY rule steering the translation prefix
+ * to splice_port, the host stack accepts the IPv6 connection on a transparent
+ * socket, the IPv4 side is an ordinary socket, and bytes move between the two
+ * with splice() through a pipe so they never enter user space.  Anything not
+ * steered here still reaches the user-space stack through the tun device.
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+
+#include "util.h"
+#include "config.h"
+#include "event.h"
+#include "defs.h"
+#include "srcpool.h"
+
+#ifndef IPV6_TRANSPARENT
+#define IPV6_TRANSPARENT	75
+#endif
+
+#define SPLICE_CHUNK		65536
+
+struct splice_map;
+
+struct splice_half
+{
+	struct splice_map *map;
+	int from;
+	int to;
+	int pipe[2];
+	int queued;		/* bytes sitting in the pipe */
+	int eof;
+
+	struct event *e_read;
+	struct event *e_write;
+};
+
+struct splice_map
+{
+	struct splice_map *next;
+	struct splice_map *prev;
+
+	int fd6;
+	int fd4;
+	struct splice_half up;	/* IPv6 client -> IPv4 server */
+	struct splice_half down;	/* IPv4 server -> IPv6 client */
+
+	struct event *e_connect;
+};
+
+static struct splice_map *slist = NULL;
+static int num_splice_maps = 0;
+
+#ifdef SPLICE_F_MOVE
+
+static int half_can_read (struct event *e, void *d);
+static int half_can_write (struct event *e, void *d);
+
+static void
+close_half (struct splice_half *h)
+{
+	if (h->e_read)
+		remove_event (h->e_read);
+	if (h->e_write)
+		remove_event (h->e_write);
+	if (h->pipe[0] >= 0)
+		close (h->pipe[0]);
+	if (h->pipe[1] >= 0)
+		close (h->pipe[1]);
+}
+
+static void
+kill_splice (struct splice_map *map)
+{
+	close_half (&map->up);
+	close_half (&map->down);
+	if (map->e_connect)
+		remove_event (map->e_connect);
+	if (map->fd6 >= 0)
+		close (map->fd6);
+	if (map->fd4 >= 0)
+		close (map->fd4);
+	if (map->next)
+		map->next->prev = map->prev;
+	if (map->prev)
+		map->prev->next = map->next;
+	if (slist == map)
+		slist = map->next;
+	fprintf (stderr, "number of spliced maps: %d\n", --num_splice_maps);
+	FREE (map);
+}
+
+static void
+init_half (struct splice_half *h, struct splice_map *map, int from, int to)
+{
+	h->map = map;
+	h->from = from;
+	h->to = to;
+	h->queued = 0;
+	h->eof = 0;
+	h->e_read = h->e_write = NULL;
+	if (pipe (h->pipe) < 0)
+		h->pipe[0] = h->pipe[1] = -1;
+}
+
+/* move what the pipe holds on to the destination; -1 on a hard error */
+static int
+half_flush (struct splice_half *h)
+{
+	ssize_t n;
+
+	while (h->queued > 0) {
+		n = splice (h->pipe[0], NULL, h->to, NULL, h->queued, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n < 0)
+			return errno == EAGAIN ? 0 : -1;
+		h->queued -= n;
+	}
+	return 0;
+}
+
+/* the half is drained after EOF: pass the FIN on, and finish when both are */
+static void
+half_done (struct splice_half *h)
+{
+	struct splice_map *map = h->map;
+
+	shutdown (h->to, SHUT_WR);
+	if (map->up.eof && !map->up.queued && map->down.eof && !map->down.queued)
+		kill_splice (map);
+}
+
+static int
+half_can_read (struct event *e, void *d)
+{
+	struct splice_half *h = d;
+	ssize_t n;
+
+	n = splice (h->from, NULL, h->pipe[1], NULL, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (n < 0) {
+		if (errno == EAGAIN)
+			return 1;
+		perror ("splice");
+		h->e_read = NULL;
+		kill_splice (h->map);
+		return 0;
+	}
+	if (n == 0)
+		h->eof = 1;
+	h->queued += n;
+
+	if (half_flush (h) < 0) {
+		perror ("splice");
+		h->e_read = NULL;
+		kill_splice (h->map);
+		return 0;
+	}
+	if (h->queued > 0) {
+		// the destination is full: stop reading until the pipe drains
+		h->e_read = NULL;
+		h->e_write = add_fd_event (h->to, 1, half_can_write, h);
+		return 0;
+	}
+	if (h->eof) {
+		h->e_read = NULL;
+		half_done (h);
+		return 0;
+	}
+	return 1;
+}
+
+static int
+half_can_write (struct event *e, void *d)
+{
+	struct splice_half *h = d;
+
+	if (half_flush (h) < 0) {
+		perror ("splice");
+		h->e_write = NULL;
+		kill_splice (h->map);
+		return 0;
+	}
+	if (h->queued > 0)
+		return 1;
+
+	h->e_write = NULL;
+	if (h->eof)
+		half_done (h);
+	else
+		h->e_read = add_fd_event (h->from, 0, half_can_read, h);
+	return 0;
+}
+
+static void
+start_splice (struct splice_map *map)
+{
+	map->up.e_read = add_fd_event (map->fd6, 0, half_can_read, &map->up);
+	map->down.e_read = add_fd_event (map->fd4, 0, half_can_read, &map->down);
+}
+
+static int
+handle_did_connect (struct event *e, void *d)
+{
+	struct splice_map *map = d;
+	socklen_t len;
+	int ret;
+
+	map->e_connect = NULL;
+
+	len = sizeof (ret);
+	getsockopt (map->fd4, SOL_SOCKET, SO_ERROR, &ret, &len);
+
+	if (ret != 0) {
+		errno = ret;
+		perror ("connect (delayed)");
+		kill_splice (map);
+	}
+	else
+		start_splice (map);
+
+	return 0;
+}
+
+static int
+handle_accept (struct event *e, void *d)
+{
+	int lfd = *(int *) d;
+	struct splice_map *map;
+	struct sockaddr_in6 local;
+	struct sockaddr_in addr;
+	socklen_t len;
+	int fd, pending;
+
+	fd = accept (lfd, NULL, NULL);
+	if (fd < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			perror ("accept");
+		return 1;
+	}
+
+	// under TPROXY the local address is the one the client dialled
+	len = sizeof (local);
+	if (getsockname (fd, (struct sockaddr *) &local, &len) < 0 || local.sin6_family != AF_INET6
+	    || memcmp (local.sin6_addr.s6_addr, globals.prefix, globals.plen / 8) != 0) {
+		close (fd);
+		return 1;
+	}
+	fcntl (fd, F_SETFL, O_NONBLOCK);
+
+	map = ALLOC (sizeof (struct splice_map));
+	fprintf (stderr, "number of spliced maps: %d\n", ++num_splice_maps);
+	map->next = slist;
+	map->prev = NULL;
+	if (map->next)
+		map->next->prev = map;
+	slist = map;
+	map->e_connect = NULL;
+	map->fd6 = fd;
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sin_family = AF_INET;
+	memcpy (&addr.sin_addr.s_addr, local.sin6_addr.s6_addr + 12, 4);
+	addr.sin_port = local.sin6_port;
+
+	map->fd4 = srcpool_connect (&addr, &pending);
+	init_half (&map->up, map, map->fd6, map->fd4);
+	init_half (&map->down, map, map->fd4, map->fd6);
+
+	if (map->fd4 < 0 || map->up.pipe[0] < 0 || map->down.pipe[0] < 0) {
+		perror ("splice setup");
+		kill_splice (map);
+	}
+	else if (pending)
+		map->e_connect = add_fd_event (map->fd4, 1, handle_did_connect, map);
+	else
+		start_splice (map);
+
+	return 1;
+}
+
+void
+ptrtd_splice_init (void)
+{
+	static int lfd;
+	struct sockaddr_in6 addr;
+	int on = 1;
+
+	if (!globals.splice_port)
+		return;
+
+	lfd = socket (PF_INET6, SOCK_STREAM, 0);
+	if (lfd < 0) {
+		syslog (LOG_ERR, "splice socket: %m\n");
+		return;
+	}
+	setsockopt (lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+	setsockopt (lfd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof (on));
+	if (setsockopt (lfd, SOL_IPV6, IPV6_TRANSPARENT, &on, sizeof (on)) < 0) {
+		// needs CAP_NET_ADMIN; the user-space stack still carries everything
+		syslog (LOG_WARNING, "IPV6_TRANSPARENT: %m, not splicing\n");
+		close (lfd);
+		return;
+	}
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_addr = in6addr_any;
+	addr.sin6_port = htons (globals.splice_port);
+	if (bind (lfd, (struct sockaddr *) &addr, sizeof (addr)) < 0 || listen (lfd, 128) < 0) {
+		syslog (LOG_ERR, "splice listener on port %d: %m\n", globals.splice_port);
+		close (lfd);
+		return;
+	}
+	fcntl (lfd, F_SETFL, O_NONBLOCK);
+	add_fd_event (lfd, 0, handle_accept, &lfd);
+	syslog (LOG_INFO, "splicing transparent TCP on port %d\n", globals.splice_port);
+}
+
+#else
+
+void
+ptrtd_splice_init (void)
+{
+	if (globals.splice_port)
+		syslog (LOG_WARNING, "splice() unavailable, not splicing\n");
+}
+
+#endif
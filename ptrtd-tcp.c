@@ -29,6 +29,7 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
@@ -38,6 +39,7 @@
 #include "event.h"
 #include "defs.h"
 #include "tcp.h"
+#include "srcpool.h"
 
 struct tcp_map
 {
@@ -80,18 +82,22 @@ static int
 handle_fd_can_read (struct event *e, void *d)
 {
 	struct tcp_map *map = d;
-	uchar tb[65536];
-	int len;
+	struct iovec iov[16];
+	int len, n, want;
 
 	printf ("handle_fd_can_read called for fd=%d\n", map->fd);
-	len = tcp_get_output_space (map->tcb);
-	if (len > sizeof (tb))
-		len = sizeof (tb);
+	// read straight into the free space of the TCP output buffer, only
+	// as much of it as the socket holds (one byte still sees EOF)
+	if (ioctl (map->fd, FIONREAD, &want) < 0 || want <= 0)
+		want = 1;
+	n = tcp_send_spans (map->tcb, iov, 16, want);
 	if (map->fp)
-		fprintf (map->fp, "we'll try to read %d into buffer\n", len);
-	if (len == 0)
+		fprintf (map->fp, "we'll try to read %d into buffer\n", tcp_get_output_space (map->tcb));
+	if (n == 0) {
+		map->e_fd_read = NULL;
 		return 0;
-	len = read (map->fd, tb, len);
+	}
+	len = readv (map->fd, iov, n);
 	if (map->fp)
 		fprintf (map->fp, "read %d from fd %d into buffer\n", len, map->fd);
 
@@ -107,7 +113,7 @@ handle_fd_can_read (struct event *e, void *d)
 		return 0;
 	}
 	else {
-		tcp_send (map->tcb, tb, len, 0);
+		tcp_send_commit (map->tcb, len);
 		if (tcp_get_output_space (map->tcb) == 0) {
 			map->e_fd_read = NULL;
 			return 0;
@@ -121,15 +127,19 @@ int
 handle_fd_can_write (struct event *e, void *d)
 {
 	struct tcp_map *map = d;
-	uchar tb[65536];
-	int len;
-
-	len = tcp_read (map->tcb, tb, sizeof (tb));
+	struct iovec iov[16];
+	int len, n, i, want = 0;
 
-	if (len < sizeof (tb))
+	// write straight out of the TCP input buffer
+	n = tcp_read_spans (map->tcb, iov, 16, 65536);
+	if (n == 0) {
 		map->e_fd_write = NULL;
+		return 0;
+	}
+	for (i = 0; i < n; ++i)
+		want += iov[i].iov_len;
 
-	len = write (map->fd, tb, len);
+	len = writev (map->fd, iov, n);
 	if (map->fp)
 		fprintf (map->fp, "wrote %d to fd %d from buffer\n", len, map->fd);
 
@@ -145,6 +155,12 @@ handle_fd_can_write (struct event *e, void *d)
 		return 0;
 	}
 
+	// only what the socket took is released; the rest waits in the
+	// buffer until the socket is writable again
+	tcp_read_commit (map->tcb, len);
+	if (len == want && tcp_read_spans (map->tcb, iov, 1, 1) == 0)
+		map->e_fd_write = NULL;
+
 	return map->e_fd_write != NULL;
 }
 
@@ -176,6 +192,7 @@ incoming (struct tcb *t, void **d, FILE * fp)
 {
 	struct tcp_map *map;
 	struct sockaddr_in addr;
+	int pending;
 
 	map = ALLOC (sizeof (struct tcp_map));
 	fprintf (stderr, "number of TCP maps: %d\n", ++num_tcp_maps);
@@ -193,24 +210,14 @@ incoming (struct tcb *t, void **d, FILE * fp)
 	memcpy (&addr.sin_addr.s_addr, tcp_get_laddr (t) + 12, 4);
 	addr.sin_port = htons (tcp_get_lport (t));
 
-	map->fd = socket (PF_INET, SOCK_STREAM, 0);
+	map->fd = srcpool_connect (&addr, &pending);
 	if (map->fd < 0) {
-		perror ("socket");
+		perror ("connect");
 		tcp_close (t, 0);
 		kill_map (map);
-		return;
-	}
-	fcntl (map->fd, F_SETFL, O_NONBLOCK);
-	if (connect (map->fd, (struct sockaddr *) &addr, sizeof (addr)) < 0) {
-		if (errno == EINPROGRESS) {
-			map->e_fd_write = add_fd_event (map->fd, 1, handle_fd_did_connect, map);
-		}
-		else {
-			perror ("connect");
-			tcp_close (t, 0);
-			kill_map (map);
-		}
 	}
+	else if (pending)
+		map->e_fd_write = add_fd_event (map->fd, 1, handle_fd_did_connect, map);
 	else
 		tcp_accept (t);
 }
@@ -20,6 +20,8 @@
  *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,22 +32,102 @@
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <syslog.h>
+#include <sys/resource.h>
 
 #include "config.h"
 #include "event.h"
 #include "defs.h"
 #include "util.h"
 #include "udp.h"
+#include "srcpool.h"
+
+#ifndef SOL_UDP
+#define SOL_UDP		17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT	103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO		104
+#endif
+
+/*
+ * One map per IPv6 (address, port).  By default each map owns an IPv4
+ * socket, so the kernel's port for it is the mapping and anyone may send
+ * back (but see udp_offload below).  With udp_ports set, maps share that many bound sockets instead:
+ * a map has a home port it uses for every destination it can (so the
+ * mapping stays endpoint-independent), and each (port, remote) pair is
+ * claimed by one map so replies can be told apart.  When the home port
+ * is already claimed toward a remote by another map, the map takes the
+ * next port free toward it.  Replies from remotes nobody has sent to are
+ * dropped.
+ */
+
+#define UDP_HASH	4096	/* buckets for maps and for claims, power of two */
+
+/*
+ * A map lives for the idle time of the destination ports it has sent to:
+ * udp_port_timeout classes (short for DNS, longer for QUIC) or udp_timeout
+ * for anything else, the longest of them once it has talked to several.
+ * Maps are also kept in least recently used order, and past udp_maps_max
+ * maps (by default three quarters of the fd limit when each map owns a
+ * socket) or when socket() runs out of fds, the least recently used one
+ * goes early.
+ */
+
+/*
+ * Both directions are batched.  A ready socket is drained with recvmmsg()
+ * into a static set of buffers, up to a budget per wakeup.  Datagrams
+ * going out are copied into a queue while a tun burst is handled, and an
+ * always-event flushes the queue with one sendmmsg() per socket once the
+ * burst is over.
+ *
+ * With udp_offload set (it is off by default), the kernel also coalesces
+ * on both sides (UDP_GRO, UDP_SEGMENT): a receive may hold a train of
+ * equal-sized datagrams from one sender, split here in one pass, and a
+ * run of equal-sized queued datagrams to one peer goes out as a single
+ * segmented send.  A map's own socket is connect()ed while it talks to
+ * one peer, which spares the kernel a route lookup per send.  That
+ * narrows the filtering: while it is connected, the kernel drops
+ * datagrams from any other remote, and only once the map has sent to a
+ * second peer may anyone send back again.  Leave udp_offload off to keep
+ * endpoint-independent filtering from the first packet.
+ */
+#define UDP_BATCH	32	/* datagrams per recvmmsg/sendmmsg */
+#define UDP_BUDGET	256	/* receives from one socket per wakeup */
+#define UDP_BUF		2048	/* one queued datagram; bigger ones are sent right away */
+#define UDP_RX_BUF	65536	/* one receive, which may be a GRO train */
+#define UDP_GSO_MAX	65507	/* bytes in one segmented send */
+#define UDP_RX_PKTS	64	/* flow queue packets one receive can become: GRO segments or IPv6 fragments */
+#define UDP_PORT_ROOM	512	/* flow queue room under which a shared port stops reading */
+
+struct udp_claim
+{
+	struct udp_claim *hnext;	/* (port, remote) hash chain */
+	struct udp_claim *next;	/* claims of the same map */
+	struct udp_map *um;
+	int port;		/* index into ports[] */
+	uchar addr4[4];
+	unsigned short rport;
+};
 
 struct udp_map
 {
 	struct udp_map *prev;
 	struct udp_map *next;
+	struct udp_map *hnext;
 
 	struct udp_socket *us;
-	int fd;
+	struct udp_flow flow;
+	int fd;			/* own socket, -1 when sharing */
+	int connected;		/* fd connected to peer; -1 once it has talked to others */
+	struct sockaddr_in peer;
+	int home;		/* shared port used when free */
+	struct udp_claim *claims;
 
 	uchar laddr[16];
 	int lport;
@@ -53,60 +135,503 @@ struct udp_map
 	int rport;
 
 	struct event *e_fd_read;
-	struct event *e_stale;
+	struct event *e_stale;	/* checks last when it fires */
+	time_ref last;
+	int idle;		/* msec */
+};
+
+struct udp_tx
+{
+	int fd;
+	int connected;		/* to dst, so no address goes with the send */
+	int len;
+	struct sockaddr_in dst;
+	uchar buf[UDP_BUF];
 };
 
-static struct udp_map *ulist = NULL;
+struct udp_port
+{
+	int fd;
+	int maps;		/* maps at home here */
+	struct event *e_read;
+};
+
+static struct udp_map *ulist = NULL;	/* most recently used first */
+static struct udp_map *utail = NULL;
+static int num_maps = 0;
+static int max_maps = 0;		/* 0 = no limit */
+static struct udp_map *map_hash[UDP_HASH];
+static struct udp_claim *claim_hash[UDP_HASH];
+static struct udp_port *ports = NULL;
+static int num_ports = 0;
+static uchar hash_key[16];
+
+static struct udp_tx tx_queue[UDP_BATCH];
+static int tx_count = 0;
+static struct event *e_tx_flush = NULL;
+
+static uchar rx_buf[UDP_BATCH][UDP_RX_BUF];
+static uchar rx_ctl[UDP_BATCH][CMSG_SPACE (sizeof (int))];
+static struct iovec rx_iov[UDP_BATCH];
+static struct sockaddr_in rx_addr[UDP_BATCH];
+static struct mmsghdr rx_msg[UDP_BATCH];
+static int gso = 0;			/* UDP_SEGMENT sends work */
 static struct udp_socket *udp_listener;
 static struct udp_callback udp_cb;
 
 static int handle_udp_read (struct event *e, void *d);
 
+static uint
+map_bucket (uchar const *raddr, int rport)
+{
+	uchar k[18];
+
+	memcpy (k, raddr, 16);
+	PUT_16 (k + 16, rport);
+	return (uint) siphash (hash_key, k, sizeof (k)) & (UDP_HASH - 1);
+}
+
+static uint
+claim_bucket (int port, uchar const *addr4, int rport)
+{
+	uchar k[8];
+
+	PUT_16 (k, port);
+	memcpy (k + 2, addr4, 4);
+	PUT_16 (k + 6, rport);
+	return (uint) siphash (hash_key, k, sizeof (k)) & (UDP_HASH - 1);
+}
+
+static struct udp_claim *
+find_claim (int port, uchar const *addr4, int rport)
+{
+	struct udp_claim *c;
+
+	for (c = claim_hash[claim_bucket (port, addr4, rport)]; c; c = c->hnext)
+		if (c->port == port && c->rport == rport && !memcmp (c->addr4, addr4, 4))
+			return c;
+	return NULL;
+}
+
+/* the shared port um sends to dst from, claiming one if needed; -1 if all are taken */
 static int
-remove_udp_map (struct event *e, void *d)
+claim_port (struct udp_map *um, struct sockaddr_in const *dst)
 {
-	struct udp_map *um = (struct udp_map *) d;
+	uchar const *addr4 = (uchar const *) &dst->sin_addr.s_addr;
+	int rport = ntohs (dst->sin_port), i, port;
+	struct udp_claim *c;
+	uint h;
 
-	fprintf (stderr, "removing stale udp map %p\n", d);
-	if (ulist == um)
+	for (c = um->claims; c; c = c->next)
+		if (c->rport == rport && !memcmp (c->addr4, addr4, 4))
+			return c->port;
+
+	for (i = 0; i < num_ports; ++i)
+		if (!find_claim ((um->home + i) % num_ports, addr4, rport))
+			break;
+	if (i == num_ports)
+		return -1;
+	port = (um->home + i) % num_ports;
+
+	c = ALLOC (sizeof (struct udp_claim));
+	c->um = um;
+	c->port = port;
+	memcpy (c->addr4, addr4, 4);
+	c->rport = rport;
+	c->next = um->claims;
+	um->claims = c;
+	h = claim_bucket (port, addr4, rport);
+	c->hnext = claim_hash[h];
+	claim_hash[h] = c;
+	return port;
+}
+
+static void
+release_claims (struct udp_map *um)
+{
+	struct udp_claim *c, **pp;
+
+	while ((c = um->claims)) {
+		um->claims = c->next;
+		for (pp = claim_hash + claim_bucket (c->port, c->addr4, c->rport); *pp != c; pp = &(*pp)->hnext);
+		*pp = c->hnext;
+		FREE (c);
+	}
+}
+
+static int
+same_dst (struct udp_tx const *a, struct udp_tx const *b)
+{
+	return a->dst.sin_port == b->dst.sin_port && a->dst.sin_addr.s_addr == b->dst.sin_addr.s_addr;
+}
+
+/* make msg one UDP_SEGMENT send of seg-sized datagrams */
+static void
+set_segment (struct mmsghdr *msg, uchar * ctl, int seg)
+{
+	struct cmsghdr *cm;
+
+	msg->msg_hdr.msg_control = ctl;
+	msg->msg_hdr.msg_controllen = CMSG_SPACE (sizeof (unsigned short));
+	cm = CMSG_FIRSTHDR (&msg->msg_hdr);
+	cm->cmsg_level = SOL_UDP;
+	cm->cmsg_type = UDP_SEGMENT;
+	cm->cmsg_len = CMSG_LEN (sizeof (unsigned short));
+	*(unsigned short *) CMSG_DATA (cm) = seg;
+}
+
+/*
+ * Send everything queued, one sendmmsg() per socket, keeping each
+ * socket's order.  Back-to-back datagrams to one peer of the run's size
+ * (the last may be shorter) share a message and go out segmented.
+ */
+static void
+tx_flush (void)
+{
+	struct mmsghdr msg[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	uchar ctl[UDP_BATCH][CMSG_SPACE (sizeof (unsigned short))];
+	uchar sent[UDP_BATCH];
+	struct udp_tx *tx, *run;
+	int i, j, n, v, ret, fd, run_bytes = 0;
+
+	memset (sent, 0, sizeof (sent));
+	memset (msg, 0, sizeof (msg));
+	for (i = 0; i < tx_count; ++i) {
+		if (sent[i])
+			continue;
+		fd = tx_queue[i].fd;
+		run = NULL;
+		for (n = 0, v = 0, j = i; j < tx_count; ++j) {
+			tx = tx_queue + j;
+			if (sent[j] || tx->fd != fd)
+				continue;
+			sent[j] = 1;
+			iov[v].iov_base = tx->buf;
+			iov[v].iov_len = tx->len;
+			if (run && tx->len <= run->len && same_dst (tx, run) && run_bytes + tx->len <= UDP_GSO_MAX) {
+				if (msg[n - 1].msg_hdr.msg_iovlen++ == 1)
+					set_segment (msg + n - 1, ctl[n - 1], run->len);
+				run_bytes += tx->len;
+				if (tx->len < run->len)
+					run = NULL;
+				++v;
+				continue;
+			}
+			run = gso ? tx : NULL;
+			run_bytes = tx->len;
+			msg[n].msg_hdr.msg_name = tx->connected ? NULL : &tx->dst;
+			msg[n].msg_hdr.msg_namelen = tx->connected ? 0 : sizeof (struct sockaddr_in);
+			msg[n].msg_hdr.msg_iov = iov + v;
+			msg[n].msg_hdr.msg_iovlen = 1;
+			// an earlier socket's run may have left its segment size here
+			msg[n].msg_hdr.msg_control = NULL;
+			msg[n].msg_hdr.msg_controllen = 0;
+			++n;
+			++v;
+		}
+		// a datagram the socket refuses is lost, like any other
+		for (j = 0; j < n; j += ret)
+			if ((ret = sendmmsg (fd, msg + j, n - j, MSG_DONTWAIT)) <= 0) {
+				if (errno == EIO && gso) {
+					// the route can't segment; stop trying
+					syslog (LOG_WARNING, "UDP_SEGMENT send failed, sending datagrams one by one\n");
+					gso = 0;
+				}
+				else
+					perror ("sendmmsg");
+				break;
+			}
+	}
+	tx_count = 0;
+}
+
+static int
+handle_tx_flush (struct event *e, void *d)
+{
+	tx_flush ();
+	e_tx_flush = NULL;
+	return 0;
+}
+
+static void
+queue_send (int fd, uchar * p, int len, struct sockaddr_in const *dst, int connected)
+{
+	struct udp_tx *tx;
+
+	if (len > UDP_BUF) {
+		// what's queued goes first, or this one would overtake it
+		if (tx_count)
+			tx_flush ();
+		sendto (fd, p, len, 0, (struct sockaddr const *) dst, sizeof (*dst));
+		return;
+	}
+	if (tx_count == UDP_BATCH)
+		tx_flush ();
+	tx = tx_queue + tx_count++;
+	tx->fd = fd;
+	tx->connected = connected;
+	tx->len = len;
+	tx->dst = *dst;
+	memcpy (tx->buf, p, len);
+	if (!e_tx_flush)
+		e_tx_flush = add_always_event (handle_tx_flush, NULL);
+}
+
+/* up to max datagrams from fd into rx_*, 0 when there are none or one was lost */
+static int
+read_batch (int fd, int max)
+{
+	int i, n;
+
+	for (i = 0; i < max; ++i) {
+		rx_iov[i].iov_base = rx_buf[i];
+		rx_iov[i].iov_len = UDP_RX_BUF;
+		memset (&rx_msg[i].msg_hdr, 0, sizeof (struct msghdr));
+		rx_msg[i].msg_hdr.msg_name = rx_addr + i;
+		rx_msg[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_in);
+		rx_msg[i].msg_hdr.msg_iov = rx_iov + i;
+		rx_msg[i].msg_hdr.msg_iovlen = 1;
+		rx_msg[i].msg_hdr.msg_control = rx_ctl[i];
+		rx_msg[i].msg_hdr.msg_controllen = sizeof (rx_ctl[i]);
+	}
+	if ((n = recvmmsg (fd, rx_msg, max, MSG_DONTWAIT, NULL)) < 0) {
+		// a peer's ICMP error (ECONNREFUSED on a connected socket and the
+		// like) is reported once and cleared; it costs no more than the
+		// datagram it stands for
+		if (errno == EBADF || errno == ENOTSOCK || errno == EFAULT || errno == EINVAL) {
+			perror ("recvmmsg");
+			exit (1);
+		}
+		return 0;
+	}
+	return n;
+}
+
+/* size of the datagrams receive i was coalesced from, or its whole length */
+static int
+rx_segment (int i)
+{
+	struct cmsghdr *cm;
+
+	for (cm = CMSG_FIRSTHDR (&rx_msg[i].msg_hdr); cm; cm = CMSG_NXTHDR (&rx_msg[i].msg_hdr, cm))
+		if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO && *(int *) CMSG_DATA (cm) > 0)
+			return *(int *) CMSG_DATA (cm);
+	return rx_msg[i].msg_len;
+}
+
+static void
+offload_setup (int fd)
+{
+	int on = 1;
+
+	if (globals.udp_offload)
+		setsockopt (fd, SOL_UDP, UDP_GRO, &on, sizeof (on));
+}
+
+/*
+ * Connect a map's socket while it has one peer.  Once a second shows up
+ * it is disconnected for good; the kernel lets go of a port it picked
+ * itself on disconnect, so the map binds the same one back right away.
+ */
+static void
+map_connect (struct udp_map *um, struct sockaddr_in const *dst)
+{
+	struct sockaddr_in self;
+	struct sockaddr sa;
+	socklen_t len;
+
+	if (um->connected < 0 || !globals.udp_offload)
+		return;
+	if (um->connected && um->peer.sin_port == dst->sin_port && um->peer.sin_addr.s_addr == dst->sin_addr.s_addr)
+		return;
+	if (tx_count)
+		tx_flush ();
+	if (!um->connected) {
+		if (connect (um->fd, (struct sockaddr const *) dst, sizeof (*dst)) == 0) {
+			um->peer = *dst;
+			um->connected = 1;
+			return;
+		}
+		um->connected = -1;
+		return;
+	}
+
+	len = sizeof (self);
+	getsockname (um->fd, (struct sockaddr *) &self, &len);
+	if (!globals.source4_len)
+		self.sin_addr.s_addr = INADDR_ANY;
+	memset (&sa, 0, sizeof (sa));
+	sa.sa_family = AF_UNSPEC;
+	connect (um->fd, &sa, sizeof (sa));
+	if (bind (um->fd, (struct sockaddr *) &self, sizeof (self)) < 0)
+		perror ("UDP rebind");
+	um->connected = -1;
+}
+
+static void
+unlink_map (struct udp_map *um)
+{
+	if (um->prev)
+		um->prev->next = um->next;
+	else
 		ulist = um->next;
 	if (um->next)
 		um->next->prev = um->prev;
-	if (um->prev)
-		um->prev->next = um->next;
-	remove_event (um->e_fd_read);
-	close (um->fd);
+	else
+		utail = um->prev;
+}
+
+/* traffic on um: it becomes the most recently used */
+static void
+touch_map (struct udp_map *um)
+{
+	time_now (&um->last);
+	if (ulist == um)
+		return;
+	unlink_map (um);
+	um->prev = NULL;
+	um->next = ulist;
+	ulist->prev = um;
+	ulist = um;
+}
+
+static void
+free_map (struct udp_map *um)
+{
+	struct udp_map **pp;
+
+	unlink_map (um);
+	for (pp = map_hash + map_bucket (um->raddr, um->rport); *pp != um; pp = &(*pp)->hnext);
+	*pp = um->hnext;
+	--num_maps;
+	udp_flow_cancel (&um->flow);
+	if (tx_count)
+		tx_flush ();
+	if (um->fd >= 0) {
+		remove_event (um->e_fd_read);
+		close (um->fd);
+	}
+	else {
+		release_claims (um);
+		--ports[um->home].maps;
+	}
 	//udp_close( um->us );
 	FREE (um);
+}
+
+static int
+remove_udp_map (struct event *e, void *d)
+{
+	struct udp_map *um = (struct udp_map *) d;
+	time_ref tr;
+
+	// refreshed by traffic since the timer was set
+	if (time_ago (&um->last) < um->idle) {
+		tr = um->last;
+		time_add (&tr, um->idle);
+		resched_time_event (e, &tr);
+		return 1;
+	}
+
+	fprintf (stderr, "removing stale udp map %p\n", d);
+	free_map (um);
 	return 0;
 }
 
+/* make room by dropping the least recently used map; 0 if there is none */
+static int
+evict_map (void)
+{
+	struct udp_map *um = utail;
+
+	if (!um)
+		return 0;
+	fprintf (stderr, "evicting udp map %p idle %d ms\n", um, time_ago (&um->last));
+	remove_event (um->e_stale);
+	free_map (um);
+	return 1;
+}
+
+/* idle time in msec for traffic to port */
+static int
+port_idle (int port)
+{
+	int i;
+
+	for (i = 0; i < globals.udp_classes; ++i)
+		if (globals.udp_class[i][0] == port)
+			return globals.udp_class[i][1] * 1000;
+	return globals.udp_timeout * 1000;
+}
+
+/* the least crowded shared port becomes a new map's home */
+static int
+pick_home (void)
+{
+	static int next = 0;
+	int i, best = next;
+
+	for (i = 0; i < num_ports; ++i)
+		if (ports[(next + i) % num_ports].maps < ports[best].maps)
+			best = (next + i) % num_ports;
+	next = (best + 1) % num_ports;
+	return best;
+}
+
 static struct udp_map *
-udp_get_map (uchar * raddr, int rport)
+udp_get_map (uchar * raddr, int rport, int idle)
 {
 	struct udp_map *um;
 	time_ref tr;
+	uint h = map_bucket (raddr, rport);
 
-	for (um = ulist; um; um = um->next)
+	for (um = map_hash[h]; um; um = um->hnext)
 		if (um->rport == rport && !memcmp (um->raddr, raddr, 16))
 			return um;
 
+	while (max_maps && num_maps >= max_maps && evict_map ());
+
 	um = ALLOC (sizeof (struct udp_map));
 	fprintf (stderr, "creating udp map %p\n", um);
+	memcpy (um->raddr, raddr, 16);
+	um->rport = rport;
+	um->us = udp_listener;
+	um->claims = NULL;
+	um->connected = 0;
+	udp_flow_init (&um->flow);
+	if (num_ports) {
+		um->fd = -1;
+		um->home = pick_home ();
+		++ports[um->home].maps;
+		um->e_fd_read = NULL;
+	}
+	else {
+		while ((um->fd = socket (AF_INET, SOCK_DGRAM, 0)) < 0)
+			if ((errno != EMFILE && errno != ENFILE) || !evict_map ()) {
+				perror ("can't make UDP socket");
+				exit (1);
+			}
+		// one IPv6 host keeps one source address
+		if (srcpool_bind (um->fd, raddr, 16) < 0)
+			perror ("UDP source pool");
+		offload_setup (um->fd);
+		um->e_fd_read = add_fd_event (um->fd, 0, handle_udp_read, um);
+	}
+	// linked in only now, so eviction above never picks this map
 	um->next = ulist;
 	um->prev = NULL;
 	if (ulist)
 		ulist->prev = um;
+	else
+		utail = um;
 	ulist = um;
-	memcpy (um->raddr, raddr, 16);
-	um->rport = rport;
-	um->us = udp_listener;
-	if ((um->fd = socket (AF_INET, SOCK_DGRAM, 0)) < 0) {
-		perror ("can't make UDP socket");
-		exit (1);
-	}
-	um->e_fd_read = add_fd_event (um->fd, 0, handle_udp_read, um);
-	time_future (&tr, 600000);
+	um->hnext = map_hash[h];
+	map_hash[h] = um;
+	++num_maps;
+	time_now (&um->last);
+	um->idle = idle;
+	time_future (&tr, idle);
 	um->e_stale = add_time_event (&tr, remove_udp_map, um);
 	return um;
 }
@@ -116,49 +641,138 @@ incoming (void *d, uchar * p, int len, uchar * laddr, int lport, uchar * raddr,
 {
 	struct udp_map *um;
 	struct sockaddr_in dst;
-	time_ref tr;
+	int fd, port, idle = port_idle (lport);
 
-	um = udp_get_map (raddr, rport);
+	um = udp_get_map (raddr, rport, idle);
+	if (idle > um->idle)
+		um->idle = idle;	// the timer catches up when it fires
+	memset (&dst, 0, sizeof (dst));
 	dst.sin_family = AF_INET;
 	memcpy (&dst.sin_addr.s_addr, laddr + 12, 4);
 	dst.sin_port = htons (lport);
 	fprintf (stderr, "Sending UDP packet to %s:%d\n", inet_ntoa (dst.sin_addr), ntohs (dst.sin_port));
-	sendto (um->fd, p, len, 0, (struct sockaddr *) &dst, sizeof (dst));
-	time_future (&tr, 600000);
-	resched_time_event (um->e_stale, &tr);
+	if ((fd = um->fd) < 0) {
+		if ((port = claim_port (um, &dst)) < 0) {
+			fprintf (stderr, "no shared UDP port free toward %s:%d\n", inet_ntoa (dst.sin_addr), ntohs (dst.sin_port));
+			return;
+		}
+		fd = ports[port].fd;
+	}
+	else
+		map_connect (um, &dst);
+	queue_send (fd, p, len, &dst, um->connected > 0);
+	touch_map (um);
+}
+
+/* hand a datagram from src back to the IPv6 side of um */
+static void
+deliver (struct udp_map *um, uchar * data, int len, struct sockaddr_in const *src)
+{
+	uchar laddr[16];
+
+	memcpy (laddr, globals.prefix, 12);
+	memcpy (laddr + 12, &src->sin_addr.s_addr, 4);
+
+	udp_flow_send (&um->flow, data, len, laddr, ntohs (src->sin_port), um->raddr, um->rport);
+	touch_map (um);
+}
+
+/* receive i, split back into the datagrams GRO merged */
+static void
+deliver_all (struct udp_map *um, int i)
+{
+	int len = rx_msg[i].msg_len, seg = rx_segment (i), off;
+
+	for (off = 0; off < len; off += seg)
+		deliver (um, rx_buf[i] + off, len - off < seg ? len - off : seg, rx_addr + i);
 }
 
 static int
 handle_udp_read (struct event *e, void *d)
 {
 	struct udp_map *um = (struct udp_map *) d;
-	int len, socklen;
-	struct sockaddr_in src;
-	uchar tb[65536];
-	uchar laddr[16];
-	uchar pfx[16];
-	time_ref tr;
+	int i, n, max, done;
 
-	socklen = sizeof (struct sockaddr_in);
-	if ((len = recvfrom (um->fd, tb, sizeof (tb), 0, (struct sockaddr *) &src, &socklen)) < 0) {
-		perror ("recvfrom");
-		exit (1);
+	// read no more than the flow can queue; the rest waits in the socket
+	for (done = 0; done < UDP_BUDGET; done += n) {
+		if ((max = udp_flow_room (&um->flow) / UDP_RX_PKTS) > UDP_BATCH)
+			max = UDP_BATCH;
+		if (!max || !(n = read_batch (um->fd, max)))
+			break;
+		for (i = 0; i < n; ++i)
+			deliver_all (um, i);
+		if (n < max)
+			break;
 	}
+	return 1;
+}
 
-	memcpy (laddr, pfx, 12);
-	memcpy (laddr + 12, &src.sin_addr.s_addr, 4);
+static int
+handle_port_read (struct event *e, void *d)
+{
+	int port = (struct udp_port *) d - ports;
+	int i, n, done, full = 0;
+	struct udp_claim *c;
 
-	udp_send (um->us, tb, len, laddr, ntohs (src.sin_port), um->raddr, um->rport);
+	/*
+	 * Which maps a batch is for is only known once it's read, so stop
+	 * after any batch that left one of them short of queue room.
+	 */
+	for (done = 0; done < UDP_BUDGET && !full; done += n) {
+		if (!(n = read_batch (ports[port].fd, UDP_BATCH)))
+			break;
+		for (i = 0; i < n; ++i)
+			if ((c = find_claim (port, (uchar const *) &rx_addr[i].sin_addr.s_addr, ntohs (rx_addr[i].sin_port)))) {
+				deliver_all (c->um, i);
+				if (udp_flow_room (&c->um->flow) < UDP_PORT_ROOM)
+					full = 1;
+			}
+		if (n < UDP_BATCH)
+			break;
+	}
+	return 1;
+}
 
-	time_future (&tr, 600000);
-	resched_time_event (um->e_stale, &tr);
+static void
+open_ports (int n)
+{
+	uchar key[4];
+	int i;
 
-	return 1;
+	ports = ALLOC (n * sizeof (struct udp_port));
+	for (i = 0; i < n; ++i) {
+		if ((ports[i].fd = socket (AF_INET, SOCK_DGRAM, 0)) < 0) {
+			perror ("can't make UDP socket");
+			exit (1);
+		}
+		fcntl (ports[i].fd, F_SETFL, O_NONBLOCK);
+		PUT_32 (key, i);
+		if (srcpool_bind (ports[i].fd, key, 4) < 0)
+			perror ("UDP source pool");
+		offload_setup (ports[i].fd);
+		ports[i].maps = 0;
+		ports[i].e_read = add_fd_event (ports[i].fd, 0, handle_port_read, ports + i);
+	}
+	num_ports = n;
 }
 
 void
 ptrtd_udp_init (void)
 {
+	struct rlimit rl;
+	int fd, zero = 0;
+
+	random_bytes (hash_key, sizeof (hash_key));
+	// kernels that know UDP_SEGMENT accept it as a socket option
+	if (globals.udp_offload && (fd = socket (AF_INET, SOCK_DGRAM, 0)) >= 0) {
+		gso = setsockopt (fd, SOL_UDP, UDP_SEGMENT, &zero, sizeof (zero)) == 0;
+		close (fd);
+	}
+	if (globals.udp_ports > 0)
+		open_ports (globals.udp_ports);
+	max_maps = globals.udp_maps_max > 0 ? globals.udp_maps_max : 0;
+	if (!max_maps && !num_ports && getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+		max_maps = rl.rlim_cur / 4 * 3;
 	udp_cb.incoming_packet = incoming;
 	udp_listener = udp_open (&udp_cb, NULL, NULL, 0);
 }
@@ -43,13 +43,40 @@
 #include "icmp.h"
 #include "buffer.h"
 #include "tcp.h"
+#include "udp.h"
+#include "gro.h"
+#include "xlat.h"
+#include "nat64.h"
+#include "frag.h"
 
-struct globals globals = { 0, {0, 0, 0, 0, 0, 0, 0, 0}, 64, "/etc/nat64d.conf", 0 };
+struct globals globals = {
+	.plen = 64,
+	.config_file = "/etc/nat64d.conf",
+	.timewait_max = 65536,
+	.syn_cookie_threshold = 1024,
+	.ecn = 1,
+	.autocork = 1,
+	.ring_mirror_min = 262144,
+	.buffer_budget = 65536,
+	.sched_quantum = 1500,
+	.pacing = 1,
+	.pacing_gain = 125,
+	.gro = 1,
+	.frag_memory = 1024,
+	.nat64_sessions = 131072,
+	.dns64_cache = 4096,
+	.udp_timeout = 600,
+	.udp_classes = 2,
+	.udp_class = {{53, 15}, {443, 120}},
+};
 
 void ptrtd_tcp_init (void);
 void ptrtd_udp_init (void);
+void ptrtd_splice_init (void);
+void ptrtd_dns64_init (void);
 
 struct iface *iface;
+static struct iface *iface4;	/* IPv4 side of the packet translators */
 
 void
 usage (char const *me)
@@ -70,7 +97,21 @@ usage (char const *me)
 void
 handle_packet (struct iface *i, struct pbuf *p)
 {
-	int sum;
+	struct pbuf *whole;
+	int sum, ret;
+
+	if (iface4 && !udp_bound (p->d, p->dlen)) {
+		ret = globals.siit ? xlat_6to4 (p) : XLAT_PASS;
+		if (ret == XLAT_PASS)
+			ret = nat64_6to4 (p);
+		switch (ret) {
+		case XLAT_DONE:
+			(*iface4->forward) (iface4, p);
+			return;
+		case XLAT_DROP:
+			return;
+		}
+	}
 
 	sum = make_cksum (p->d, p->dlen);
 	switch (p->d[6]) {
@@ -78,11 +119,20 @@ handle_packet (struct iface *i, struct pbuf *p)
 		handle_icmp (p->d, p->dlen);
 		break;
 	case 6:
-		handle_tcp (p->d, p->dlen);
+		if (i->batch && globals.gro)
+			gro_receive (p->d, p->dlen);
+		else
+			handle_tcp (p->d, p->dlen);
 		break;
 	case 17:
 		handle_udp (p->d, p->dlen);
 		break;
+	case 44:
+		if ((whole = frag_receive (p->d, p->dlen))) {
+			handle_packet (i, whole);
+			pbuf_delete (whole);
+		}
+		break;
 	case 0:
 		break;
 	default:
@@ -90,6 +140,35 @@ handle_packet (struct iface *i, struct pbuf *p)
 	}
 }
 
+/* packets from the IPv4 tun only ever go through the translators */
+static void
+handle_packet4 (struct iface *i, struct pbuf *p)
+{
+	struct pbuf *q;
+	int ret;
+
+	if (p->dlen >= 20 && nat64_owns (p->d + 16))
+		ret = nat64_4to6 (p);
+	else
+		ret = globals.siit ? xlat_4to6 (p) : XLAT_DROP;
+	if (ret != XLAT_DONE)
+		return;
+	if (iface->forward) {
+		(*iface->forward) (iface, p);
+		return;
+	}
+	q = iface->get_buffer (iface, p->dlen);
+	memcpy (q->d, p->d, p->dlen);
+	q->dlen = p->dlen;
+	send_pkt (iface, q);
+}
+
+static void
+handle_batch_end (struct iface *i)
+{
+	gro_flush ();
+}
+
 void
 init_iface (char *type, char *dev)
 {
@@ -101,6 +180,7 @@ init_iface (char *type, char *dev)
 		syslog(LOG_ERR, "Unable to create %s interface.\n", type);
 		exit (1);
 	}
+	iface->batch_end = handle_batch_end;
 	if (!strcmp (type, "tap")) {
 		tap_get_name (iface, ifname);
 		do_config = 1;
@@ -125,6 +205,19 @@ init_iface (char *type, char *dev)
 		rc = system (cmd);
 	}
 	icmp_init_iface (iface);
+
+	if (globals.siit || globals.pool4_len > 0) {
+		iface4 = create_iface ("tun4", NULL, handle_packet4);
+		if (!iface4) {
+			syslog (LOG_ERR, "Unable to create tun4 interface.\n");
+			exit (1);
+		}
+		tun_get_name (iface4, ifname);
+		syslog (LOG_INFO, "IPv4 tunnel: %s\n", ifname);
+		sprintf (cmd, "/sbin/ip link set %s up", ifname);
+		syslog (LOG_INFO, "command: %s\n", cmd);
+		system (cmd);
+	}
 }
 
 int
@@ -190,6 +283,8 @@ main (int argc, char **argv)
 
 	ptrtd_tcp_init ();
 	ptrtd_udp_init ();
+	ptrtd_splice_init ();
+	ptrtd_dns64_init ();
 
 	init_iface (itype, iname);
 
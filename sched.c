@@ -0,0 +1,225 @@
+/*
+ *  sched.c
+ *
+ *  ptrtd - Portable IPv6 TRT implementation
+ *
+ *  Copyright (C) 2001  Nathan Lutchansky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "config.h"
+#include "defs.h"
+#include "util.h"
+#include "event.h"
+#include "sched.h"
+
+/*
+ * Transmit scheduler.  Each pass of the event loop first sends every
+ * pending control segment, then gives each flow with data one
+ * deficit-round-robin turn: quantum bytes more credit, spent a packet
+ * at a time, with any overdraft carried into the next round.  A flow
+ * that runs dry leaves the round and forfeits its credit; one that is
+ * paced is parked until its release time and keeps it.
+ */
+
+static struct tx_flow *bulk_head = NULL;
+static struct tx_flow *bulk_tail = NULL;
+static struct tx_flow *prio_head = NULL;
+static struct tx_flow *prio_tail = NULL;
+static int bulk_count = 0;
+static struct tx_flow *parked = NULL;
+static struct event *e_sched = NULL;
+static struct event *e_release = NULL;
+
+static void
+bulk_unlink (struct tx_flow *f)
+{
+	if (f->next)
+		f->next->prev = f->prev;
+	else
+		bulk_tail = f->prev;
+	if (f->prev)
+		f->prev->next = f->next;
+	else
+		bulk_head = f->next;
+	f->next = f->prev = NULL;
+	f->lanes &= ~SCHED_BULK;
+	--bulk_count;
+}
+
+// move paced flows whose time has come back to the bulk lane
+static int
+sched_release (struct event *e, void *d)
+{
+	struct tx_flow *f;
+	time_ref now;
+
+	time_now (&now);
+	while ((f = parked) && time_diff (&now, &f->release) <= 0) {
+		parked = f->wnext;
+		f->wnext = NULL;
+		f->lanes &= ~SCHED_PARKED;
+		sched_wake (f, SCHED_BULK);
+	}
+	if (parked)
+		resched_time_event (e, &parked->release);
+	else
+		e_release = NULL;
+	return 0;
+}
+
+static void
+sched_park (struct tx_flow *f)
+{
+	struct tx_flow **pp;
+
+	if (f->lanes & SCHED_PARKED)
+		return;
+	f->lanes |= SCHED_PARKED;
+	for (pp = &parked; *pp && time_diff (&(*pp)->release, &f->release) >= 0; pp = &(*pp)->wnext);
+	f->wnext = *pp;
+	*pp = f;
+	if (!e_release)
+		e_release = add_time_event (&f->release, sched_release, NULL);
+	else if (parked == f)
+		resched_time_event (e_release, &f->release);
+}
+
+static int
+sched_run (struct event *e, void *d)
+{
+	struct tx_flow *f;
+	int n, round;
+
+	while ((f = prio_head)) {
+		if (!(prio_head = f->pnext))
+			prio_tail = NULL;
+		f->pnext = NULL;
+		f->lanes &= ~SCHED_PRIO;
+		(*f->xmit) (f, SCHED_PRIO);
+	}
+
+	for (round = bulk_count; round > 0 && (f = bulk_head); --round) {
+		bulk_unlink (f);
+		f->deficit += globals.sched_quantum;
+		n = 1;
+		while (f->deficit > 0 && (n = (*f->xmit) (f, SCHED_BULK)) > 0)
+			f->deficit -= n;
+		// xmit may have woken it again itself
+		if (n > 0)
+			sched_wake (f, SCHED_BULK);
+		else if (n < 0)
+			sched_park (f);
+		else if (!(f->lanes & SCHED_BULK))
+			f->deficit = 0;
+	}
+
+	if (!prio_head && !bulk_head) {
+		e_sched = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+void
+sched_init_flow (struct tx_flow *f, int (*xmit) (struct tx_flow * f, int lane))
+{
+	f->next = f->prev = f->pnext = f->wnext = NULL;
+	timerclear (&f->release);
+	f->xmit = xmit;
+	f->deficit = 0;
+	f->lanes = 0;
+}
+
+void
+sched_wake (struct tx_flow *f, int lane)
+{
+	// a parked flow is woken by its release timer
+	if ((f->lanes & lane) || (lane == SCHED_BULK && (f->lanes & SCHED_PARKED)))
+		return;
+	f->lanes |= lane;
+	if (lane == SCHED_PRIO) {
+		if (prio_tail)
+			prio_tail->pnext = f;
+		else
+			prio_head = f;
+		prio_tail = f;
+	}
+	else {
+		f->prev = bulk_tail;
+		++bulk_count;
+		if (bulk_tail)
+			bulk_tail->next = f;
+		else
+			bulk_head = f;
+		bulk_tail = f;
+	}
+	if (!e_sched)
+		e_sched = add_always_event (sched_run, NULL);
+}
+
+void
+sched_cancel (struct tx_flow *f)
+{
+	struct tx_flow **pp;
+
+	if (f->lanes & SCHED_BULK)
+		bulk_unlink (f);
+	if (f->lanes & SCHED_PRIO) {
+		for (pp = &prio_head; *pp != f; pp = &(*pp)->pnext);
+		*pp = f->pnext;
+		if (prio_tail == f)
+			for (prio_tail = prio_head; prio_tail && prio_tail->pnext; prio_tail = prio_tail->pnext);
+		f->pnext = NULL;
+		f->lanes &= ~SCHED_PRIO;
+	}
+	if (f->lanes & SCHED_PARKED) {
+		for (pp = &parked; *pp != f; pp = &(*pp)->wnext);
+		*pp = f->wnext;
+		f->wnext = NULL;
+		f->lanes &= ~SCHED_PARKED;
+	}
+}
+
+/*
+ * Pacing.  A paced sender asks sched_paced before each packet and,
+ * once it has sent one, pushes its release time on with sched_pace by
+ * the packet's share of the interval.  Timers have millisecond
+ * resolution, so anything due within the current millisecond goes
+ * out at once.
+ */
+int
+sched_paced (struct tx_flow *f)
+{
+	return time_ago (&f->release) < 0;
+}
+
+void
+sched_pace (struct tx_flow *f, int usec)
+{
+	time_ref now;
+
+	time_now (&now);
+	if (time_diff (&f->release, &now) > 0)
+		f->release = now;
+	f->release.tv_usec += usec;
+	f->release.tv_sec += f->release.tv_usec / 1000000;
+	f->release.tv_usec %= 1000000;
+}
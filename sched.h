@@ -0,0 +1,59 @@
+/*
+ *  sched.h
+ *
+ *  ptrtd - Portable IPv6 TRT implementation
+ *
+ *  Copyright (C) 2001  Nathan Lutchansky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _SCHED_H
+#define _SCHED_H
+
+#include "event.h"
+
+#define SCHED_PRIO	1	/* a control segment: ACK, SYN-ACK, window update */
+#define SCHED_BULK	2	/* data */
+#define SCHED_PARKED	4	/* paced, waiting for its release time */
+
+#define SCHED_DEFER	(-1)	/* xmit: not before f->release */
+
+/*
+ * Something that queues packets for the interface: a tcb, or the
+ * return path of a UDP mapping.  xmit sends one packet from the given
+ * lane and returns its size, 0 if that lane has nothing to send, or
+ * SCHED_DEFER if pacing holds it back until f->release.  It must not
+ * free the flow; owners call sched_cancel before that.
+ */
+struct tx_flow
+{
+	struct tx_flow *next;	/* bulk lane */
+	struct tx_flow *prev;
+	struct tx_flow *pnext;	/* priority lane */
+	struct tx_flow *wnext;	/* parked, in release order */
+	int (*xmit) (struct tx_flow * f, int lane);
+	int deficit;		/* bytes left of this round's quantum */
+	unsigned char lanes;	/* which lanes the flow is queued on */
+	time_ref release;	/* pacing: earliest time for the next packet */
+};
+
+void sched_init_flow (struct tx_flow *f, int (*xmit) (struct tx_flow * f, int lane));
+void sched_wake (struct tx_flow *f, int lane);
+void sched_cancel (struct tx_flow *f);
+int sched_paced (struct tx_flow *f);
+void sched_pace (struct tx_flow *f, int usec);
+
+#endif /* _SCHED_H */
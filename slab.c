@@ -0,0 +1,90 @@
+/*
+ *  slab.c
+ *
+ *  ptrtd - Portable IPv6 TRT implementation
+ *
+ *  Copyright (C) 2001  Nathan Lutchansky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "config.h"
+#include "defs.h"
+#include "util.h"
+#include "slab.h"
+
+void
+slab_init (struct slab_cache *c, char const *name, int size, int align, int per_slab)
+{
+	if (size < sizeof (void *))
+		size = sizeof (void *);
+	c->name = name;
+	c->align = align;
+	c->size = (size + align - 1) & ~(align - 1);
+	c->per_slab = per_slab;
+	c->free = NULL;
+	c->in_use = 0;
+	c->total = 0;
+}
+
+static int
+slab_grow (struct slab_cache *c)
+{
+	char *block;
+	int i;
+
+	if (posix_memalign ((void **) &block, c->align, c->size * c->per_slab)) {
+		syslog (LOG_ERR, "out of memory growing %s slab\n", c->name);
+		return -1;
+	}
+#ifdef TRACK_MEMORY
+	g_allocated += c->size * c->per_slab;
+#endif
+
+	for (i = c->per_slab - 1; i >= 0; --i) {
+		*(void **) (block + i * c->size) = c->free;
+		c->free = block + i * c->size;
+	}
+	c->total += c->per_slab;
+	return 0;
+}
+
+void *
+slab_alloc (struct slab_cache *c)
+{
+	void *p;
+
+	if (!c->free && slab_grow (c) < 0)
+		return NULL;
+
+	p = c->free;
+	c->free = *(void **) p;
+	++c->in_use;
+	return p;
+}
+
+void
+slab_free (struct slab_cache *c, void *p)
+{
+	*(void **) p = c->free;
+	c->free = p;
+	--c->in_use;
+}
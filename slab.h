@@ -0,0 +1,50 @@
+/*
+ *  slab.h
+ *
+ *  ptrtd - Portable IPv6 TRT implementation
+ *
+ *  Copyright (C) 2001  Nathan Lutchansky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#define CACHE_LINE	64
+
+/*
+ * Fixed-size object allocator.  Objects are carved out of big aligned
+ * blocks and recycled through a free list, so allocation and release
+ * are O(1) and objects never share a cache line with a neighbour
+ * unless the caller asked for a smaller alignment.
+ */
+
+struct slab_cache
+{
+	char const *name;
+	int size;		/* object size, rounded up to align */
+	int align;
+	int per_slab;
+	void *free;		/* singly linked through the first word */
+	int in_use;
+	int total;
+};
+
+void slab_init (struct slab_cache *c, char const *name, int size, int align, int per_slab);
+void *slab_alloc (struct slab_cache *c);
+void slab_free (struct slab_cache *c, void *p);
+
+#endif /* _SLAB_H */
@@ -0,0 +1,154 @@
+/*
+ *  srcpool.c
+ *
+ *  ptrtd - Portable IPv6 TRT implementation
+ *
+ *  Copyright (C) 2001  Nathan Lutchansky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+
+#include "config.h"
+#include "defs.h"
+#include "util.h"
+#include "srcpool.h"
+
+/*
+ * Source addresses for upstream IPv4 sockets.  Without a pool the kernel
+ * picks one address and its ephemeral range, which caps connections to
+ * any one destination at the size of that range.  With a pool, a hash of
+ * the destination picks the first address to try, and when that address
+ * has no port left for the destination the next one is tried, so the
+ * cap grows with the pool.  TCP binds with IP_BIND_ADDRESS_NO_PORT: the
+ * port is only chosen at connect() time, against the full 4-tuple, so
+ * one port can serve many destinations.
+ */
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT	24
+#endif
+#ifndef IP_LOCAL_PORT_RANGE
+#define IP_LOCAL_PORT_RANGE	51
+#endif
+
+static uchar pool_key[16];
+static int keyed = 0;
+
+static uint
+pool_size (void)
+{
+	if (globals.source4_len <= 0)
+		return 0;
+	return 1u << (32 - globals.source4_len);
+}
+
+/* the i-th pool address after the one key hashes to */
+static void
+pool_addr (struct sockaddr_in *a, uchar const *key, int len, uint i)
+{
+	uint n = pool_size (), base = GET_32 (globals.source4) & ~(n - 1);
+
+	if (!keyed) {
+		random_bytes (pool_key, sizeof (pool_key));
+		keyed = 1;
+	}
+	memset (a, 0, sizeof (*a));
+	a->sin_family = AF_INET;
+	a->sin_addr.s_addr = htonl (base + (uint) ((siphash (pool_key, key, len) + i) % n));
+	a->sin_port = 0;
+}
+
+static void
+port_range (int fd)
+{
+	uint range;
+
+	if (!globals.source_port_min && !globals.source_port_max)
+		return;
+	range = (globals.source_port_max << 16) | globals.source_port_min;
+	setsockopt (fd, IPPROTO_IP, IP_LOCAL_PORT_RANGE, &range, sizeof (range));
+}
+
+/*
+ * A nonblocking TCP socket connecting (or connected, *pending == 0) to
+ * dst from a pool address; -1 with errno set if none would do.
+ */
+int
+srcpool_connect (struct sockaddr_in const *dst, int *pending)
+{
+	struct sockaddr_in src;
+	uint i = 0, n = pool_size ();
+	int fd, on = 1;
+
+	do {
+		if ((fd = socket (PF_INET, SOCK_STREAM, 0)) < 0)
+			return -1;
+		fcntl (fd, F_SETFL, O_NONBLOCK);
+		if (n) {
+			pool_addr (&src, (uchar const *) &dst->sin_addr.s_addr, 4, i);
+			setsockopt (fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof (on));
+			port_range (fd);
+			if (bind (fd, (struct sockaddr *) &src, sizeof (src)) < 0) {
+				close (fd);
+				return -1;
+			}
+		}
+		if (connect (fd, (struct sockaddr const *) dst, sizeof (*dst)) == 0) {
+			*pending = 0;
+			return fd;
+		}
+		if (errno == EINPROGRESS) {
+			*pending = 1;
+			return fd;
+		}
+		close (fd);
+		// this address is out of ports for dst, try the next
+	} while (errno == EADDRNOTAVAIL && ++i < n);
+	return -1;
+}
+
+/*
+ * Bind a UDP socket to a pool address picked by key, moving on while an
+ * address has no free port.  Without a pool the socket is left alone.
+ */
+int
+srcpool_bind (int fd, uchar const *key, int len)
+{
+	struct sockaddr_in src;
+	uint i, n = pool_size ();
+
+	if (!n)
+		return 0;
+	port_range (fd);
+	for (i = 0; i < n; ++i) {
+		pool_addr (&src, key, len, i);
+		if (bind (fd, (struct sockaddr *) &src, sizeof (src)) == 0)
+			return 0;
+		if (errno != EADDRINUSE)
+			break;
+	}
+	return -1;
+}
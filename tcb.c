@@ -25,6 +25,7 @@
 #include <string.h>
 #include <sys/time.h>
 #include <stdio.h>
+#include <syslog.h>
 
 #include "util.h"
 #include "config.h"
@@ -32,75 +33,244 @@
 #include "buffer.h"
 #include "tcb.h"
 
-struct rb_root tcblist = RB_ROOT;
+/*
+ * Established (and half-open) connections live in an open-addressing
+ * hash table keyed by the full 4-tuple.  Listeners are few, so they sit
+ * on their own short list and are only consulted when the exact lookup
+ * misses.
+ *
+ * When the table fills up a new one is allocated and the old one is
+ * drained a few slots at a time by every later operation, so growing
+ * never stalls a single packet.  Lookups check both tables while a
+ * migration is in progress.
+ */
 
-static int
-tcbcmp (struct tcb const *a, struct tcb const *b)
-{
-	int rc = b->rport - a->rport;
-	if (rc == 0) {
-		rc = b->lport - a->lport;
-		if (rc == 0) {
-			rc = memcmp (a->raddr, b->raddr, 16);
-			if (rc == 0) {
-				rc = memcmp (a->raddr, b->raddr, 16);
-			}
-		}
+#define TCB_TOMB		((struct tcb *) 1)
+#define TCB_TABLE_MIN		64
+#define TCB_MIGRATE_STEP	8
+
+struct tcb_table
+{
+	struct tcb **slot;
+	uint mask;		/* size - 1, size is a power of two */
+	uint used;		/* live entries */
+	uint tombs;		/* deleted markers */
+};
+
+static struct tcb_table tcbtab;	/* where new entries go */
+static struct tcb_table tcbold;	/* being drained, if slot != NULL */
+static uint migrate_pos;
+static uchar hash_key[16];
+static int hash_key_set = 0;
+
+static struct slab_cache tcb_slab;
+static struct slab_cache cold_slab;
+
+static struct tcb *listeners = NULL;
+static struct tcb *all_tcbs = NULL;
+static int num_tcbs = 0;
+
+#ifdef DEBUG
+int tcb_find_visits = 0;
+int tcb_find_calls = 0;
+#endif
+
+static uint
+tcb_hash (uchar const *laddr, int lport, uchar const *raddr, int rport)
+{
+	uchar k[36];
+
+	if (!hash_key_set) {
+		random_bytes (hash_key, sizeof (hash_key));
+		hash_key_set = 1;
 	}
-	return rc;
+	memcpy (k, laddr, 16);
+	memcpy (k + 16, raddr, 16);
+	PUT_16 (k + 32, lport);
+	PUT_16 (k + 34, rport);
+	return (uint) siphash (hash_key, k, sizeof (k));
+}
+
+static inline int
+tcb_match (struct tcb const *t, uint h, uchar const *laddr, int lport, uchar const *raddr, int rport)
+{
+	return t->hash == h && t->lport == lport && t->rport == rport
+	    && !memcmp (t->raddr, raddr, 16) && !memcmp (t->laddr, laddr, 16);
 }
 
 static int
-tcb_insert (struct rb_root *root, struct tcb *tcb)
+table_alloc (struct tcb_table *tab, uint size)
 {
-	struct rb_node **new = &(root->rb_node), *parent = 0;
+	tab->slot = ALLOC (size * sizeof (struct tcb *));
+	if (!tab->slot)
+		return -1;
+	memset (tab->slot, 0, size * sizeof (struct tcb *));
+	tab->mask = size - 1;
+	tab->used = 0;
+	tab->tombs = 0;
+	return 0;
+}
 
-	while (*new) {
-		struct tcb *this = container_of (*new, struct tcb, node);
-		int result = tcbcmp (tcb, this);
+static struct tcb *
+table_lookup (struct tcb_table const *tab, uint h, uchar const *laddr, int lport, uchar const *raddr, int rport)
+{
+	uint i;
+	struct tcb *t;
 
-		parent = *new;
-		if (result < 0)
-			new = &((*new)->rb_left);
-		else if (result > 0)
-			new = &((*new)->rb_right);
-		else
-			return 0;
+	for (i = h & tab->mask; (t = tab->slot[i]); i = (i + 1) & tab->mask) {
+#ifdef DEBUG
+		++tcb_find_visits;
+#endif
+		if (t != TCB_TOMB && tcb_match (t, h, laddr, lport, raddr, rport))
+			return t;
 	}
+	return NULL;
+}
 
-	rb_link_node (&tcb->node, parent, new);
-	rb_insert_color (&tcb->node, root);
+static void
+table_insert (struct tcb_table *tab, struct tcb *t)
+{
+	uint i;
 
-	return 1;
+	for (i = t->hash & tab->mask; tab->slot[i] && tab->slot[i] != TCB_TOMB; i = (i + 1) & tab->mask);
+	if (tab->slot[i] == TCB_TOMB)
+		--tab->tombs;
+	tab->slot[i] = t;
+	++tab->used;
 }
 
-static struct tcb *
-tcb_find_rb (struct rb_root const *root, struct tcb const *tcb)
+static int
+table_remove (struct tcb_table *tab, struct tcb const *t)
+{
+	uint i;
+
+	for (i = t->hash & tab->mask; tab->slot[i]; i = (i + 1) & tab->mask)
+		if (tab->slot[i] == t) {
+			// a tombstone in front of an empty slot is useless
+			if (!tab->slot[(i + 1) & tab->mask])
+				tab->slot[i] = NULL;
+			else {
+				tab->slot[i] = TCB_TOMB;
+				++tab->tombs;
+			}
+			--tab->used;
+			return 1;
+		}
+	return 0;
+}
+
+/* move up to n slots from the old table into the current one */
+static void
+migrate (uint n)
 {
-	struct rb_node *node = root->rb_node;
+	struct tcb *t;
 
-	while (node) {
-		struct tcb *data = container_of (node, struct tcb, node);
-		int result = tcbcmp (tcb, data);
+	if (!tcbold.slot)
+		return;
 
-		if (result < 0)
-			node = node->rb_left;
-		else if (result > 0)
-			node = node->rb_right;
-		else
-			return data;
+	for (; n > 0 && migrate_pos <= tcbold.mask; --n, ++migrate_pos) {
+		t = tcbold.slot[migrate_pos];
+		if (t && t != TCB_TOMB)
+			table_insert (&tcbtab, t);
 	}
 
-	return 0;
+	if (migrate_pos > tcbold.mask) {
+		FREE (tcbold.slot);
+		tcbold.slot = NULL;
+	}
+}
+
+static void
+table_grow (void)
+{
+	uint size = tcbtab.mask + 1;
+
+	if ((tcbtab.used + tcbtab.tombs + 1) * 2 <= size)
+		return;
+
+	// can't start another migration while one is running; this
+	// only happens if the step size is too small for the growth rate
+	if (tcbold.slot)
+		migrate (tcbold.mask + 1);
+
+	// mostly tombstones: rehash at the same size
+	if (tcbtab.used * 4 >= size)
+		size *= 2;
+
+	tcbold = tcbtab;
+	migrate_pos = 0;
+	if (table_alloc (&tcbtab, size) < 0) {
+		syslog (LOG_ERR, "can't grow connection table to %u\n", size);
+		tcbtab = tcbold;
+		tcbold.slot = NULL;
+	}
+}
+
+static void
+tcb_insert (struct tcb *t)
+{
+	if (!tcbtab.slot)
+		table_alloc (&tcbtab, TCB_TABLE_MIN);
+
+	migrate (TCB_MIGRATE_STEP);
+	table_grow ();
+	t->hash = tcb_hash (t->laddr, t->lport, t->raddr, t->rport);
+	table_insert (&tcbtab, t);
+}
+
+static void
+tcb_remove (struct tcb *t)
+{
+	migrate (TCB_MIGRATE_STEP);
+	if (!table_remove (&tcbtab, t) && tcbold.slot)
+		table_remove (&tcbold, t);
+}
+
+static struct tcb *
+listener_find (uchar const *laddr, int lport)
+{
+	static uchar const any[16];
+	struct tcb *t, *best = NULL;
+	int score, best_score = -1;
+
+	if (!laddr)
+		laddr = any;
+
+	// exact address and port beats wildcard address beats wildcard port
+	for (t = listeners; t; t = t->next) {
+		if (t->lport != lport && t->lport != 0)
+			continue;
+		if (memcmp (t->laddr, laddr, 16) && memcmp (t->laddr, any, 16))
+			continue;
+		score = (t->lport != 0) * 2 + (memcmp (t->laddr, any, 16) != 0);
+		if (score > best_score) {
+			best = t;
+			best_score = score;
+		}
+	}
+	return best;
 }
 
 struct tcb *
 tcb_new (uchar * laddr, int lport, uchar * raddr, int rport)
 {
 	struct tcb *t;
+	struct tcb_cold *cold;
+
+	if (!tcb_slab.size) {
+		slab_init (&tcb_slab, "tcb", sizeof (struct tcb), CACHE_LINE, 64);
+		slab_init (&cold_slab, "tcb_cold", sizeof (struct tcb_cold), sizeof (void *), 128);
+	}
 
-	t = ALLOC (sizeof (struct tcb));
+	if (!(t = slab_alloc (&tcb_slab)))
+		return NULL;
+	if (!(cold = slab_alloc (&cold_slab))) {
+		slab_free (&tcb_slab, t);
+		return NULL;
+	}
 	memset (t, 0, sizeof (struct tcb));
+	memset (cold, 0, sizeof (struct tcb_cold));
+	t->cold = cold;
 
 	if (laddr)
 		memcpy (t->laddr, laddr, 16);
@@ -111,20 +281,36 @@ tcb_new (uchar * laddr, int lport, uchar * raddr, int rport)
 	t->lport = lport;
 	t->rport = rport;
 
-	gettimeofday (&t->start_time, NULL);
+	gettimeofday (&t->cold->start_time, NULL);
 
 	if (globals.debug >= 5) {
 		char fn[128];
 
 		sprintf (fn, "session.%d", rport);
-		if (!(t->fp = fopen (fn, "w"))) {
+		if (!(t->cold->fp = fopen (fn, "w"))) {
 			perror ("fopen");
 			exit (1);
 		}
-		setvbuf (t->fp, NULL, _IONBF, 0);
+		setvbuf (t->cold->fp, NULL, _IONBF, 0);
+		t->flags |= TCB_F_TRACE;
 	}
 
-	tcb_insert (&tcblist, t);
+	if (raddr) {
+		tcb_insert (t);
+		t->next = all_tcbs;
+		t->prev = NULL;
+		if (all_tcbs)
+			all_tcbs->prev = t;
+		all_tcbs = t;
+		++num_tcbs;
+	}
+	else {
+		t->next = listeners;
+		t->prev = NULL;
+		if (listeners)
+			listeners->prev = t;
+		listeners = t;
+	}
 
 	return t;
 }
@@ -136,48 +322,65 @@ tcb_delete (struct tcb *t)
 		rb_delete (t->inbuf);
 	if (t->outbuf)
 		rb_delete (t->outbuf);
-	if (t->fp)
-		fclose (t->fp);
-
-	rb_erase (&t->node, &tcblist);
-	FREE (t);
+	if (t->cold->fp)
+		fclose (t->cold->fp);
+
+	if (t->next)
+		t->next->prev = t->prev;
+	if (t->prev)
+		t->prev->next = t->next;
+	if (t->state == TCP_LISTEN) {
+		if (listeners == t)
+			listeners = t->next;
+	}
+	else {
+		tcb_remove (t);
+		if (all_tcbs == t)
+			all_tcbs = t->next;
+		--num_tcbs;
+	}
+	slab_free (&cold_slab, t->cold);
+	slab_free (&tcb_slab, t);
 }
 
 struct tcb *
 tcb_find (uchar * laddr, int lport, uchar * raddr, int rport)
 {
-	struct tcb *t;
-	struct tcb needle;
-
-	if (!laddr) {
-		memset (needle.laddr, 0, 16);
-	}
-	else {
-		memcpy (needle.laddr, laddr, 16);
+	struct tcb *t = NULL;
+	uint h;
+
+#ifdef DEBUG
+	++tcb_find_calls;
+#endif
+	if (raddr && laddr && tcbtab.slot) {
+		migrate (TCB_MIGRATE_STEP);
+		h = tcb_hash (laddr, lport, raddr, rport);
+		t = table_lookup (&tcbtab, h, laddr, lport, raddr, rport);
+		if (!t && tcbold.slot)
+			t = table_lookup (&tcbold, h, laddr, lport, raddr, rport);
 	}
-	if (!raddr) {
-		memset (needle.raddr, 0, 16);
-	}
-	else {
-		memcpy (needle.raddr, raddr, 16);
-	}
-
-	needle.lport = lport;
-	needle.rport = rport;
-
-	t = tcb_find_rb (&tcblist, &needle);
 
 	if (t)
 		return t;
 
-	if (!raddr)
-		return tcb_find (laddr, lport, NULL, 0);
+	return listener_find (laddr, lport);
+}
 
-	if (!laddr)
-		return tcb_find (NULL, lport, NULL, 0);
+/* Iterate over all connections, newest first.  Listeners aren't included. */
+struct tcb *
+tcb_first (void)
+{
+	return all_tcbs;
+}
 
-	if (lport > 0)
-		return tcb_find (NULL, 0, NULL, 0);
+struct tcb *
+tcb_next (struct tcb const *t)
+{
+	return t->next;
+}
 
-	return NULL;
+int
+tcb_count (void)
+{
+	return num_tcbs;
 }
@@ -28,67 +28,104 @@
 #include "event.h"
 #include "tcp.h"
 #include "buffer.h"
-#include "rbtree.h"
+#include "slab.h"
+#include "sched.h"
 
 #ifdef DEBUG
 extern int tcb_find_visits;
 extern int tcb_find_calls;
 #endif
 
-struct tcb
+#define TCB_F_TRACE	0x0001	/* cold->fp is open */
+#define TCB_F_ACCEPTED	0x0002	/* the app has called tcp_accept */
+#define TCB_F_PERSIST	0x0004	/* e_timeout is the persist timer */
+#define TCB_F_ECN	0x0008	/* ECN was negotiated */
+#define TCB_F_ECE	0x0010	/* got CE, echo ECE until the peer sends CWR */
+#define TCB_F_CWR	0x0020	/* we reduced cwnd, tell the peer */
+#define TCB_F_NODELAY	0x0040	/* never hold back small segments */
+
+/* Things only the status page, the debug trace and connection setup look at. */
+struct tcb_cold
 {
-	struct rb_node node;
+	struct timeval start_time;
+	FILE *fp;
 
-	int state;
+	uint iss;
+	uint irs;
+	uint rcv_up;
 
-	uchar laddr[16];
-	int lport;
-	uchar raddr[16];
-	int rport;
+	time_ref rtt_time;	// when we sent the segment containing rtt_mark
 
-	struct ringbuf *inbuf;
-	struct ringbuf *outbuf;
+	time_ref tune_time;	// buffer autotuning: when snd_una and rcv_nxt
+	uint tune_snd;		// were last sampled, and what they were
+	uint tune_rcv;
+};
 
-	void *app_data;
-	struct tcp_callback *cb;
+/*
+ * Laid out by access pattern: the first cache line holds everything an
+ * established connection reads and writes for a data segment or an ACK,
+ * the second the timers, RTT estimator and callbacks, the third what is
+ * only touched when walking the tcb list, hashing, building headers or
+ * reacting to an ECN echo, and the fourth the transmit scheduler state.
+ */
+struct tcb
+{
+	short state;
+	unsigned short flags;
 
 	uint snd_una;
 	uint snd_nxt;
+	uint snd_max;
 	uint snd_wnd;
 	uint snd_cwnd;
-	uint snd_max;
-	uint iss;
 	uint mss;
 	uint rcv_nxt;
 	uint rcv_wnd;
-	uint rcv_up;
-	uint irs;
-
 	uint last_acked;
+	uint read_seq;		/* next seqnum for app to read */
+	uint packets;
 
-	uint timeout_mark;	// seqnum
+	struct ringbuf *inbuf;
+	struct ringbuf *outbuf;
+
+	/* second cache line */
+	struct event *e_timeout;
+
+	void *app_data;
+	struct tcp_callback *cb;
 
+	uint timeout_mark;	// seqnum
 	uint rtt_mark;		// seqnum being used to measure RTT
 	uint rtt_limit;		// smallest seqnum we can measure RTT with
-	time_ref rtt_time;	// when we sent the segment containing rtt_mark
 	int srtt;		// smoothed mean RT time, in msec
 	int sdev;		// smoothed RT time mean deviation, in msec
 
-	struct timeval start_time;
-	struct timeval atime;
-	uint packets;
-	FILE *fp;
-
-	uint read_seq;		/* next seqnum for app to read */
+	struct tcb_cold *cold;
+	unsigned char persist_shift;	/* persist timer backoff */
+	unsigned char persist_probes;	/* window probes since the last ACK */
+
+	/* third cache line */
+	struct tcb *next;	/* list of all tcbs, for tcb_first/tcb_next */
+	struct tcb *prev;
+	uint hash;		/* cached 4-tuple hash */
+	uint cwr_seq;		/* no more ECN reductions until this is acked */
+	unsigned short lport;
+	unsigned short rport;
+	uchar laddr[16];
+	uchar raddr[16];
 
-	struct event *e_tcb_send;
-	struct event *e_timeout;
-};
+	/* fourth cache line */
+	struct tx_flow tx;	/* transmit scheduling, see sched.c */
+} __attribute__ ((aligned (CACHE_LINE)));
 
-extern struct rb_root tcblist;
+#define TCB_TRACE(t, ...) \
+	do { if ((t)->flags & TCB_F_TRACE) fprintf ((t)->cold->fp, __VA_ARGS__); } while (0)
 
 struct tcb *tcb_new (uchar * laddr, int lport, uchar * raddr, int rport);
 void tcb_delete (struct tcb *t);
 struct tcb *tcb_find (uchar * laddr, int lport, uchar * raddr, int rport);
+struct tcb *tcb_first (void);
+struct tcb *tcb_next (struct tcb const *t);
+int tcb_count (void);
 
 #endif /* _TCB_H */
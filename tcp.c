@@ -33,6 +33,8 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <syslog.h>
+#include <time.h>
+#include <stddef.h>
 
 #include "config.h"
 #include "event.h"
@@ -42,6 +44,7 @@
 #include "icmp.h"
 #include "buffer.h"
 #include "tcb.h"
+#include "timewait.h"
 
 extern struct iface *iface;
 
@@ -50,7 +53,8 @@ char const *const stname[] = { "CLOSED", "LISTEN", "SYN_SENT", "SYN_RECVD",
 	"CLOSING", "LAST_ACK", "TIME_WAIT"
 };
 
-static int do_tcb_write (struct event *e, void *d);
+static int tcp_xmit (struct tx_flow *f, int lane);
+static void tcp_check_persist (struct tcb *t);
 
 static uint
 next_isn (void)
@@ -60,6 +64,89 @@ next_isn (void)
 	return (++isn) << 16;
 }
 
+/*
+ * SYN cookies.  Once more than globals.syn_cookie_threshold connections
+ * are half-open, a SYN gets a SYN-ACK whose ISS encodes everything we
+ * need to know, and no state is kept until the ACK comes back:
+ *
+ *   bits 31-27  coarse time (64 second units, mod 32)
+ *   bits 26-24  index into cookie_mss[]
+ *   bits 23-0   keyed MAC of the 4-tuple, peer ISS and time
+ */
+
+#define COOKIE_SLOT(now)	((uint) (now) >> 6)
+
+static int half_open = 0;
+static uint cookie_slot = 0;	/* when we last sent one */
+static uchar cookie_key[16];
+static int cookie_key_set = 0;
+static const int cookie_mss[] = { 536, 1024, 1220 };
+
+static uint
+cookie_mac (uchar const *p, uint irs, uint slot)
+{
+	uchar k[44];
+
+	if (!cookie_key_set) {
+		random_bytes (cookie_key, sizeof (cookie_key));
+		cookie_key_set = 1;
+	}
+	memcpy (k, p + 8, 32);	// both addresses
+	memcpy (k + 32, p + 40, 4);	// both ports
+	PUT_32 (k + 36, irs);
+	PUT_32 (k + 40, slot);
+	return (uint) siphash (cookie_key, k, sizeof (k)) & 0xffffff;
+}
+
+static uint
+syn_cookie_make (uchar const *p, int mss)
+{
+	uint slot = COOKIE_SLOT (time (NULL));
+	int i;
+
+	for (i = sizeof (cookie_mss) / sizeof (int) - 1; i > 0 && cookie_mss[i] > mss; --i);
+	cookie_slot = slot;
+	return ((slot & 0x1f) << 27) | (i << 24) | cookie_mac (p, GET_32 (p + 44), slot);
+}
+
+/* returns the MSS encoded in a valid cookie, 0 if it isn't one */
+static int
+syn_cookie_check (uchar const *p)
+{
+	uint cookie = GET_32 (p + 48) - 1;
+	uint slot = COOKIE_SLOT (time (NULL));
+	uint age = (slot - (cookie >> 27)) & 0x1f;
+	int i = (cookie >> 24) & 0x7;
+
+	if (slot - cookie_slot > 1 || age > 1 || i >= sizeof (cookie_mss) / sizeof (int))
+		return 0;
+	if (cookie_mac (p, GET_32 (p + 44) - 1, slot - age) != (cookie & 0xffffff))
+		return 0;
+	return cookie_mss[i];
+}
+
+/* the peer's MSS option, or the RFC 1122 default */
+static int
+tcp_peer_mss (uchar const *p, int len)
+{
+	int i, end = 40 + 4 * (p[52] >> 4);
+
+	if (end > len)
+		end = len;
+	for (i = 60; i < end && p[i] != 0;) {
+		if (p[i] == 1) {
+			++i;
+			continue;
+		}
+		if (i + 1 >= end || p[i + 1] < 2)
+			break;
+		if (p[i] == 2 && p[i + 1] == 4 && i + 4 <= end)
+			return GET_16 (p + i + 2);
+		i += p[i + 1];
+	}
+	return 536;
+}
+
 static int
 make_tcp_hdr (struct tcb *t, uchar * buf, int dlen, int flags, int optwords)
 {
@@ -78,6 +165,8 @@ make_tcp_hdr (struct tcb *t, uchar * buf, int dlen, int flags, int optwords)
 	PUT_32 (buf + 44, t->snd_nxt);
 	PUT_32 (buf + 48, t->rcv_nxt);
 	buf[52] = (optwords + 5) << 4;
+	if (t->flags & TCB_F_ECE)
+		flags |= 0x40;
 	buf[53] = flags;
 	PUT_16 (buf + 54, t->rcv_wnd);
 
@@ -89,18 +178,30 @@ make_tcp_hdr (struct tcb *t, uchar * buf, int dlen, int flags, int optwords)
 	return totlen;
 }
 
+// queue for data, a FIN, or a SYN-ACK (which always goes first)
 static void
 mark_for_if_write (struct tcb *t)
 {
-	if (t->e_tcb_send)
-		return;
-	t->e_tcb_send = add_always_event (do_tcb_write, t);
+	sched_wake (&t->tx, t->state == TCP_SYN_RECVD ? SCHED_PRIO : SCHED_BULK);
+}
+
+// queue an ACK or window update that shouldn't wait behind bulk data
+static void
+mark_for_ack (struct tcb *t)
+{
+	sched_wake (&t->tx, SCHED_PRIO);
 }
 
 int
 tcp_accept (struct tcb *t)
 {
+	t->flags |= TCB_F_ACCEPTED;
 	mark_for_if_write (t);
+
+	// a connection set up from a SYN cookie may already have data
+	// waiting for an app that couldn't take it yet
+	if (t->state == TCP_ESTABLISHED && t->cb && rb_avail (t->inbuf, t->read_seq) > 0)
+		t->cb->data_available (t->app_data, rb_avail (t->inbuf, t->read_seq));
 	return 0;
 }
 
@@ -128,18 +229,85 @@ tcp_get_lport (struct tcb *t)
 	return t->lport;
 }
 
-static int
-tcp_remove (struct event *e, void *d)
+static void
+tcp_destroy (struct tcb *t)
 {
-	struct tcb *t = d;
-
-	syslog (LOG_INFO, "removing tcb %p\n", d);
-	if (t->e_tcb_send)
-		remove_event (t->e_tcb_send);
+	if (t->state == TCP_SYN_RECVD)
+		--half_open;
+	sched_cancel (&t->tx);
 	if (t->e_timeout)
 		remove_event (t->e_timeout);
 	tcb_delete (t);
-	return 0;
+}
+
+#define TCP_BUF_MIN	(16 * 1024)	/* per direction, also the initial size */
+#define TCP_BUF_MAX	(256 * 1024)
+
+/*
+ * The receive window is what's left in inbuf, as far as 16 bits go
+ * since we don't do window scaling.  Once the buffers of all
+ * connections fill the last quarter of the budget, it is squeezed
+ * down towards a single segment.
+ */
+static uint
+rcv_window (struct tcb *t)
+{
+	int wnd = rb_left (t->inbuf);
+	long long budget = globals.buffer_budget * 1024LL, room;
+
+	if (wnd > 65535)
+		wnd = 65535;
+	if (budget > 0 && (room = budget - rb_bytes_used) < budget / 4) {
+		wnd = wnd * (room > 0 ? room : 0) / (budget / 4);
+		if (wnd < t->mss)
+			wnd = t->mss < rb_left (t->inbuf) ? t->mss : rb_left (t->inbuf);
+	}
+	return wnd;
+}
+
+/*
+ * Size one direction's buffer at twice the bytes it moved per round
+ * trip.  Growing is only allowed while the budget is less than half
+ * used; an oversized buffer shrinks once it is four times the need.
+ */
+static void
+tcp_tune_buffer (struct tcb *t, struct ringbuf *r, uint bdp)
+{
+	int size = rb_size (r), want = 2 * bdp;
+
+	if (want < TCP_BUF_MIN)
+		want = TCP_BUF_MIN;
+	if (want > TCP_BUF_MAX)
+		want = TCP_BUF_MAX;
+	if (want > size) {
+		if (globals.buffer_budget > 0 && rb_bytes_used >= globals.buffer_budget * 1024LL / 2)
+			return;
+	}
+	else if (2 * want > size)
+		return;
+	TCB_TRACE (t, "autotune %s: %d -> %d\n", r == t->inbuf ? "inbuf" : "outbuf", size, rb_resize (r, want));
+}
+
+static void
+tcp_autotune (struct tcb *t)
+{
+	struct tcb_cold *c = t->cold;
+	uint sent = t->snd_una - c->tune_snd, rcvd = t->rcv_nxt - c->tune_rcv;
+	int elapsed, rtt;
+
+	// sample once a direction has moved half its buffer
+	if (2 * sent < rb_size (t->outbuf) && 2 * rcvd < rb_size (t->inbuf))
+		return;
+
+	elapsed = max_int (time_ago (&c->tune_time), 1);
+	rtt = t->srtt > 0 ? t->srtt : elapsed;
+	tcp_tune_buffer (t, t->outbuf, (unsigned long long) sent * rtt / elapsed);
+	tcp_tune_buffer (t, t->inbuf, (unsigned long long) rcvd * rtt / elapsed);
+	t->rcv_wnd = rcv_window (t);
+
+	c->tune_snd = t->snd_una;
+	c->tune_rcv = t->rcv_nxt;
+	time_now (&c->tune_time);
 }
 
 static inline int
@@ -156,8 +324,7 @@ window_update (struct tcb *t)
 	if (t->snd_cwnd > t->snd_wnd)
 		t->snd_cwnd = t->snd_wnd;
 	t->snd_max = t->snd_una + t->snd_cwnd;
-	if (t->fp)
-		fprintf (t->fp, "snd_wnd=%d snd_cwnd=%d snd_max=%x\n", t->snd_wnd, t->snd_cwnd, t->snd_max);
+	TCB_TRACE (t, "snd_wnd=%d snd_cwnd=%d snd_max=%x\n", t->snd_wnd, t->snd_cwnd, t->snd_max);
 	return window_size (t);
 }
 
@@ -166,55 +333,67 @@ tcp_timeout (struct event *e, void *d)
 {
 	struct tcb *t = d;
 
-	if (t->fp)
-		fprintf (t->fp, "*** timeout!!!  resetting to %x\n", t->snd_una);
+	TCB_TRACE (t, "*** timeout!!!  resetting to %x\n", t->snd_una);
 	t->e_timeout = NULL;
 	t->snd_nxt = t->snd_una;
 	t->rtt_mark = t->snd_una - 1;	// don't use lost packets to measure RTT
 	t->snd_cwnd = 0;	// this gets reset to the minimum in window_update
 	window_update (t);
 	mark_for_if_write (t);
+	tcp_check_persist (t);
 	return 1;
 }
 
+/* send a bare segment that doesn't belong to any tcb, with an MSS
+ * option if mss is nonzero */
 static void
-tcp_fabricate_rst (uchar * data)
+tcp_send_raw (uchar const *laddr, int lport, uchar const *raddr, int rport, uint seq, uint ack, int flags, int wnd, int mss)
 {
 	struct pbuf *p;
-	int sum;
-
-	syslog (LOG_INFO, "Sending TCP rst port=%d\n", GET_16 (data + 40));
+	int sum, len = mss ? 64 : 60;
 
-	p = (*iface->get_buffer) (iface, 60);
-	memset (p->d, 0, 60);
+	p = (*iface->get_buffer) (iface, len);
+	memset (p->d, 0, len);
 	p->d[0] = 0x60;		//version
-	PUT_16 (p->d + 4, 20);
+	PUT_16 (p->d + 4, len - 40);
 	p->d[6] = 0x6;		//tcp
 	p->d[7] = 0x40;		//ttl
-	memcpy (p->d + 8, data + 24, 16);
-	memcpy (p->d + 24, data + 8, 16);
-	PUT_16 (p->d + 40, GET_16 (data + 42));
-	PUT_16 (p->d + 42, GET_16 (data + 40));
-	PUT_32 (p->d + 44, GET_32 (data + 48));
-	PUT_32 (p->d + 48, GET_32 (data + 44) + 1);
-	p->d[52] = 5 << 4;
-	p->d[53] = 0x14;
-
-	sum = ~make_cksum (p->d, 60);
+	memcpy (p->d + 8, laddr, 16);
+	memcpy (p->d + 24, raddr, 16);
+	PUT_16 (p->d + 40, lport);
+	PUT_16 (p->d + 42, rport);
+	PUT_32 (p->d + 44, seq);
+	PUT_32 (p->d + 48, ack);
+	p->d[52] = (len - 40) << 2;
+	p->d[53] = flags;
+	PUT_16 (p->d + 54, wnd);
+	if (mss) {
+		p->d[60] = 2;
+		p->d[61] = 4;
+		PUT_16 (p->d + 62, mss);
+	}
+
+	sum = ~make_cksum (p->d, len);
 	PUT_16 (p->d + 56, sum);
 
-	p->dlen = 60;
-	//dump_packet( "TCP reset", p );
+	p->dlen = len;
 	send_pkt (iface, p);
 }
 
+static void
+tcp_fabricate_rst (uchar * data)
+{
+	syslog (LOG_INFO, "Sending TCP rst port=%d\n", GET_16 (data + 40));
+
+	tcp_send_raw (data + 24, GET_16 (data + 42), data + 8, GET_16 (data + 40), GET_32 (data + 48), GET_32 (data + 44) + 1, 0x14, 0, 0);
+}
+
 static void
 tcp_send_rst (struct tcb *t)
 {
 	struct pbuf *p;
 
-	if (t->fp)
-		fprintf (t->fp, "Sending TCP rst port=%d\n", t->rport);
+	TCB_TRACE (t, "Sending TCP rst port=%d\n", t->rport);
 
 	p = (*iface->get_buffer) (iface, 60);
 	memset (p->d, 0, 60);
@@ -236,9 +415,8 @@ tcp_send_syn (struct tcb *t)
 	p->d[60] = 2;
 	p->d[61] = 4;
 	PUT_16 (p->d + 62, 1216);
-	len = make_tcp_hdr (t, p->d, 0, 0x12, 1);
-	if (t->fp)
-		fprintf (t->fp, "Sending TCP syn port=%d seq=%x ack=%x flags=%x\n", t->rport, t->snd_nxt, t->rcv_nxt, p->d[53]);
+	len = make_tcp_hdr (t, p->d, 0, t->flags & TCB_F_ECN ? 0x52 : 0x12, 1);
+	TCB_TRACE (t, "Sending TCP syn port=%d seq=%x ack=%x flags=%x\n", t->rport, t->snd_nxt, t->rcv_nxt, p->d[53]);
 	++t->snd_nxt;
 	p->dlen = len;
 	send_pkt (iface, p);
@@ -248,16 +426,11 @@ tcp_send_syn (struct tcb *t)
 int
 tcp_close (struct tcb *t, int hard)
 {
-	if (t->fp)
-		fprintf (t->fp, "closing connection...\n");
+	TCB_TRACE (t, "closing connection...\n");
 
-	if (hard || t->state == TCP_SYN_RECVD) {
+	if (hard || t->state == TCP_SYN_RECVD || !(t->flags & TCB_F_ACCEPTED)) {
 		tcp_send_rst (t);
-		if (t->e_tcb_send)
-			remove_event (t->e_tcb_send);
-		if (t->e_timeout)
-			remove_event (t->e_timeout);
-		tcb_delete (t);
+		tcp_destroy (t);
 		return 0;
 	}
 
@@ -269,6 +442,7 @@ tcp_close (struct tcb *t, int hard)
 	else
 		t->state = TCP_LAST_ACK;
 	mark_for_if_write (t);
+	tcp_check_persist (t);
 	return 0;
 }
 
@@ -295,16 +469,123 @@ set_timeout (struct tcb *t)
 	time_future (&tr, m);
 	t->e_timeout = add_time_event (&tr, tcp_timeout, t);
 	t->timeout_mark = t->snd_nxt;
-	if (t->fp)
-		fprintf (t->fp, "timeout set for %x\n", t->timeout_mark);
+	TCB_TRACE (t, "timeout set for %x\n", t->timeout_mark);
+}
+
+/*
+ * Persist timer.  While the peer advertises a zero window and we have
+ * data or a FIN waiting, probe it with exponential backoff so a lost
+ * window update can't stall the connection.  A peer that stops
+ * answering the probes altogether gets reset.
+ */
+
+#define TCP_PERSIST_MAX		60000	/* msec */
+#define TCP_PERSIST_PROBES	12
+
+static int
+persist_pending (struct tcb *t)
+{
+	int avail = rb_avail (t->outbuf, t->snd_nxt);
+
+	if (avail > 0)
+		return 1;
+	// a FIN that hasn't gone out yet
+	return avail == 0 && (t->state == TCP_FIN_WAIT_1 || t->state == TCP_CLOSING || t->state == TCP_LAST_ACK);
+}
+
+static int tcp_persist (struct event *e, void *d);
+
+static void
+set_persist (struct tcb *t)
+{
+	time_ref tr;
+	int m;
+
+	m = t->srtt + 4 * t->sdev;
+	if (m < 500)
+		m = 500;
+	m <<= t->persist_shift;
+	if (m >= TCP_PERSIST_MAX)
+		m = TCP_PERSIST_MAX;
+	else
+		++t->persist_shift;
+
+	time_future (&tr, m);
+	if (t->e_timeout)
+		resched_time_event (t->e_timeout, &tr);
+	else
+		t->e_timeout = add_time_event (&tr, tcp_persist, t);
+	t->flags |= TCB_F_PERSIST;
+	TCB_TRACE (t, "persist timer set for %d msec\n", m);
+}
+
+static void
+tcp_check_persist (struct tcb *t)
+{
+	if (t->snd_wnd == 0) {
+		if (!t->e_timeout && persist_pending (t))
+			set_persist (t);
+	}
+	else if (t->flags & TCB_F_PERSIST) {
+		remove_event (t->e_timeout);
+		t->e_timeout = NULL;
+		t->flags &= ~TCB_F_PERSIST;
+		t->persist_shift = 0;
+	}
 }
 
-// return 1 for can do again, 0 for all done
+static int
+tcp_persist (struct event *e, void *d)
+{
+	struct tcb *t = d;
+
+	// the event loop removes e unless it gets rescheduled
+	t->e_timeout = NULL;
+	t->flags &= ~TCB_F_PERSIST;
+
+	if (t->snd_wnd > 0 || !persist_pending (t)) {
+		t->persist_shift = 0;
+		mark_for_if_write (t);
+		return 1;
+	}
+
+	if (++t->persist_probes > TCP_PERSIST_PROBES) {
+		syslog (LOG_INFO, "zero window probes unanswered, resetting port %d\n", t->rport);
+		if (t->cb)
+			t->cb->closing (t->app_data, 1);
+		tcp_send_rst (t);
+		tcp_destroy (t);
+		return 0;
+	}
+
+	// an old sequence number makes the peer answer with its window
+	TCB_TRACE (t, "window probe %d\n", t->persist_probes);
+	tcp_send_raw (t->laddr, t->lport, t->raddr, t->rport, t->snd_una - 1, t->rcv_nxt, 0x10, t->rcv_wnd, 0);
+	t->e_timeout = e;
+	set_persist (t);
+	return 1;
+}
+
+/*
+ * Autocork: while earlier data is still unacknowledged, hold back a
+ * segment shorter than the MSS.  More small writes from the server can
+ * join it in the buffer, and the ACK that arrives for the data in
+ * flight sends whatever has gathered by then.
+ */
+static int
+tcp_corked (struct tcb *t, int len)
+{
+	return globals.autocork && !(t->flags & TCB_F_NODELAY) && t->state == TCP_ESTABLISHED && len < t->mss
+	    && t->snd_nxt != t->snd_una;
+}
+
+// returns the size of the segment sent, 0 if there was nothing to
+// send, or SCHED_DEFER if pacing holds the next one back
 static int
 tcp_send_and_ack (struct tcb *t)
 {
 	struct pbuf *p;
-	int len = 0, wnd;
+	int len = 0, wnd, sent;
 	int flags = 0x10;
 
 	p = (*iface->get_buffer) (iface, 1500);
@@ -316,11 +597,20 @@ tcp_send_and_ack (struct tcb *t)
 				len = t->mss;
 			if (len > wnd)
 				len = wnd;
-			len = rb_read (t->outbuf, t->snd_nxt, p->d + 60, len);
-			if (rb_avail (t->outbuf, t->snd_nxt + len) == 0)
-				flags |= 0x8;	// psh
-			if (t->fp)
-				fprintf (t->fp, "read %d from buffer to send\n", len);
+			if (tcp_corked (t, len)) {
+				TCB_TRACE (t, "corking %d bytes\n", len);
+				len = 0;
+			}
+			else if (globals.pacing && t->srtt > 0 && sched_paced (&t->tx)) {
+				pbuf_delete (p);
+				return SCHED_DEFER;
+			}
+			else {
+				len = rb_read (t->outbuf, t->snd_nxt, p->d + 60, len);
+				if (rb_avail (t->outbuf, t->snd_nxt + len) == 0)
+					flags |= 0x8;	// psh
+				TCB_TRACE (t, "read %d from buffer to send\n", len);
+			}
 		}
 		else
 			len = 0;
@@ -331,12 +621,11 @@ tcp_send_and_ack (struct tcb *t)
 		    && (t->state == TCP_FIN_WAIT_1 || t->state == TCP_CLOSING || t->state == TCP_LAST_ACK))
 			flags |= 0x1;
 	}
-	else if (t->fp)
-		fprintf (t->fp, "No data to send because wnd==0\n");
+	else
+		TCB_TRACE (t, "No data to send because wnd==0\n");	// persist timer's job
 
 	if (len == 0 && !(flags & 0x1) && t->last_acked >= t->rcv_nxt) {
-		if (t->fp)
-			fprintf (t->fp, "*** tcp_send_and_ack called, but nothing to do! len=%d\n", len);
+		TCB_TRACE (t, "*** tcp_send_and_ack called, but nothing to do! len=%d\n", len);
 		pbuf_delete (p);
 		return 0;
 	}
@@ -346,16 +635,22 @@ tcp_send_and_ack (struct tcb *t)
 
 	if (len > 0 && t->rtt_mark < t->snd_una && t->snd_nxt >= t->rtt_limit) {
 		t->rtt_mark = t->snd_nxt;
-		time_now (&t->rtt_time);
-		if (t->fp)
-			fprintf (t->fp, "Setting RTT timer at %x\n", t->rtt_mark);
+		time_now (&t->cold->rtt_time);
+		TCB_TRACE (t, "Setting RTT timer at %x\n", t->rtt_mark);
+	}
+
+	if (len > 0 && (t->flags & TCB_F_CWR)) {
+		flags |= 0x80;
+		t->flags &= ~TCB_F_CWR;
 	}
 
 	p->dlen = make_tcp_hdr (t, p->d, len, flags, 0);
 
-	if (t->fp)
-		fprintf (t->fp,
-			 "Sending TCP data port=%d seq=%x ack=%x datalen=%d flags=%x\n", t->rport, t->snd_nxt, t->rcv_nxt, len, p->d[53]);
+	// ECT(0) on new data only, never on retransmissions or pure ACKs
+	if (len > 0 && (t->flags & TCB_F_ECN) && t->snd_nxt >= t->rtt_limit)
+		p->d[1] |= 0x20;
+
+	TCB_TRACE (t, "Sending TCP data port=%d seq=%x ack=%x datalen=%d flags=%x\n", t->rport, t->snd_nxt, t->rcv_nxt, len, p->d[53]);
 
 	t->snd_nxt += len;
 	if (flags & 0x1)
@@ -365,25 +660,81 @@ tcp_send_and_ack (struct tcb *t)
 		t->rtt_limit = t->snd_nxt;
 
 	//dump_packet( "Send TCP data", p );
+	sent = p->dlen;
 	send_pkt (iface, p);
 	++t->packets;
 
-	wnd = window_size (t);
-	if (t->fp)
-		fprintf (t->fp, "after this send, %u left in window\n", wnd);
+	// pace data at pacing_gain percent of cwnd per srtt
+	if (len > 0 && globals.pacing && t->srtt > 0 && t->snd_cwnd > 0)
+		sched_pace (&t->tx, (long long) sent * t->srtt * 1000 * 100 / ((long long) globals.pacing_gain * t->snd_cwnd));
 
-	switch (t->state) {
-	case TCP_ESTABLISHED:
-		// why was this here?
-		//t->cb->output_buffer_space( t->app_data,
-		//              rb_left( t->outbuf ) );
-		return wnd > 0 && rb_avail (t->outbuf, t->snd_nxt) > 0;
-	case TCP_FIN_WAIT_1:
-	case TCP_CLOSING:
-	case TCP_LAST_ACK:
-		return wnd > 0 && rb_avail (t->outbuf, t->snd_nxt) > -1;
+	TCB_TRACE (t, "after this send, %u left in window\n", window_size (t));
+	return sent;
+}
+
+static int
+tcp_send_ack (struct tcb *t)
+{
+	struct pbuf *p;
+	int sent;
+
+	p = (*iface->get_buffer) (iface, 60);
+	sent = p->dlen = make_tcp_hdr (t, p->d, 0, 0x10, 0);
+	TCB_TRACE (t, "Sending ACK port=%d ack=%x\n", t->rport, t->rcv_nxt);
+	send_pkt (iface, p);
+	++t->packets;
+	return sent;
+}
+
+/*
+ * Only the sequence numbers are needed to answer a retransmitted FIN,
+ * so the tcb and its buffers go away here and a compact entry in the
+ * time-wait table stands in for it.
+ */
+static void
+tcp_time_wait (struct tcb *t)
+{
+	// the ACK of the peer's FIN has to go out before the tcb does
+	if (t->last_acked != t->rcv_nxt)
+		tcp_send_and_ack (t);
+
+	t->state = TCP_TIME_WAIT;
+	if (!tw_insert (t->laddr, t->lport, t->raddr, t->rport, t->snd_nxt, t->rcv_nxt))
+		syslog (LOG_INFO, "no time-wait entry for port %d\n", t->rport);
+	tcp_destroy (t);
+}
+
+/*
+ * A segment for a connection in TIME_WAIT.  Returns 1 if it was dealt
+ * with here, 0 if it's a SYN that may start a new incarnation, in which
+ * case *isn_floor is set to a sequence number the new ISS must exceed.
+ */
+static int
+tcp_time_wait_input (struct tw_entry *tw, uchar * p, int len, uint * isn_floor)
+{
+	uchar laddr[16];
+	int flags = p[53] & 0x3f;
+	int dlen = len - (40 + 4 * (p[52] >> 4));
+
+	if (flags & 0x4) {
+		tw_remove (tw);
+		return 1;
 	}
-	return 0;
+
+	// RFC 1122 4.2.2.13: a SYN above the old window may reopen it
+	if ((flags & 0x12) == 0x2 && (int) (GET_32 (p + 44) - tw->rcv_nxt) > 0) {
+		*isn_floor = tw->snd_nxt;
+		tw_remove (tw);
+		return 0;
+	}
+
+	// ack retransmitted FINs and anything else carrying sequence space;
+	// answering pure ACKs could start an ACK loop
+	if (flags & 0x3 || dlen > 0) {
+		tw_laddr (tw, laddr);
+		tcp_send_raw (laddr, tw->lport, tw->raddr, tw->rport, tw->snd_nxt, tw->rcv_nxt, 0x10, 0, 0);
+	}
+	return 1;
 }
 
 static int
@@ -395,125 +746,189 @@ tcp_recv_data (struct tcb *t, uchar * p, int len)
 	doff = 40 + 4 * (p[52] >> 4);
 	dlen = len - doff;
 
+	// only acknowledge what fits; the peer resends the rest
+	if (t->cb && dlen > rb_left (t->inbuf)) {
+		dlen = rb_left (t->inbuf);
+		flags &= ~0x1;
+	}
+
 	if (dlen > 0) {
-		p[len] = 0;	// only necessary for this printf
-		if (t->fp)
-			fprintf (t->fp, "data: '%s'\n", p + doff);
+		if (t->flags & TCB_F_TRACE) {
+			p[len] = 0;	// only necessary for this printf
+			fprintf (t->cold->fp, "data: '%s'\n", p + doff);
+		}
 		t->rcv_nxt += dlen;
-		mark_for_if_write (t);	// need ack
+		mark_for_ack (t);
 
 		// if no callbacks, just throw away the received data
 
 		if (t->cb) {
 			rb_write (t->inbuf, p + doff, dlen);
-			t->rcv_wnd = rb_left (t->inbuf);
+			t->rcv_wnd = rcv_window (t);
 			t->cb->data_available (t->app_data, rb_avail (t->inbuf, t->read_seq));
 		}
 	}
 
 	if (flags & 0x1) {
 		++t->rcv_nxt;
-		mark_for_if_write (t);
+		mark_for_ack (t);
 		return 1;
 	}
 
 	return 0;
 }
 
+/*
+ * Build the tcb for a connection on listener lt, either on its SYN or,
+ * for a SYN cookie, on the ACK that completes the handshake.  irs and
+ * iss are the initial sequence numbers, i.e. those of the SYNs.
+ */
+static struct tcb *
+tcp_new_session (struct tcb *lt, uchar * p, int state, uint irs, uint iss, int mss, uint isn_floor)
+{
+	struct tcb *t;
+
+	t = tcb_new (p + 24, GET_16 (p + 42), p + 8, GET_16 (p + 40));
+	if (!t)
+		return NULL;
+	if (isn_floor && (int) (iss - isn_floor) <= 0)
+		iss = isn_floor + 0x10000;
+
+	t->inbuf = rb_new (TCP_BUF_MIN);
+	t->outbuf = rb_new (TCP_BUF_MIN);
+	t->state = state;
+	t->cold->irs = irs;
+	t->read_seq = t->rcv_nxt = irs + 1;
+	rb_set (t->inbuf, t->rcv_nxt);
+	t->cold->iss = iss;
+	t->snd_nxt = t->snd_una = state == TCP_SYN_RECVD ? iss : iss + 1;
+	t->rtt_mark = t->snd_nxt - 1;
+	t->rtt_limit = t->snd_nxt + 1;
+	t->cwr_seq = t->snd_nxt;
+	rb_set (t->outbuf, iss + 1);
+	t->mss = mss < 1220 ? mss : 1220;
+	t->rcv_wnd = rcv_window (t);
+	sched_init_flow (&t->tx, tcp_xmit);
+	t->cold->tune_snd = t->snd_una;
+	t->cold->tune_rcv = t->rcv_nxt;
+	time_now (&t->cold->tune_time);
+	t->snd_cwnd = 0;
+	t->snd_wnd = GET_16 (p + 54);
+	window_update (t);
+	t->cb = lt->cb;
+	if (state == TCP_SYN_RECVD) {
+		++half_open;
+		// ECN-setup SYN: both ECE and CWR
+		if (globals.ecn && (p[53] & 0xc0) == 0xc0)
+			t->flags |= TCB_F_ECN;
+	}
+	if (globals.nodelay_ports[t->lport >> 3] & (1 << (t->lport & 7)))
+		t->flags |= TCB_F_NODELAY;
+	return t;
+}
+
 int
 handle_tcp (uchar * p, int len)
 {
 	int rport, lport, flags;
 	struct tcb *t;
+	struct tw_entry *tw;
+	uint isn_floor = 0;
 
 	lport = GET_16 (p + 42);
 	rport = GET_16 (p + 40);
 	flags = p[53] & 0x3f;
 	t = tcb_find (p + 24, lport, p + 8, rport);
+	if ((t == NULL || t->state == TCP_LISTEN) && (tw = tw_find (p + 24, lport, p + 8, rport))
+	    && tcp_time_wait_input (tw, p, len, &isn_floor))
+		return 0;
 	if (t == NULL) {
 		syslog (LOG_WARNING, "No matching tcb for %d!\n", lport);
 		tcp_fabricate_rst (p);
 		return 0;
 	}
-	gettimeofday (&t->atime, NULL);
-	if (t->fp)
-		fprintf (t->fp,
-			 "Received TCP packet port %d seq=%x ack=%x state=%s flags=%x datalen=%d\n",
-			 rport, GET_32 (p + 44), GET_32 (p + 48), stname[t->state], flags, len - (40 + 4 * (p[52] >> 4)));
+	TCB_TRACE (t, "Received TCP packet port %d seq=%x ack=%x state=%s flags=%x datalen=%d\n",
+		   rport, GET_32 (p + 44), GET_32 (p + 48), stname[t->state], flags, len - (40 + 4 * (p[52] >> 4)));
 	if (t->state == TCP_LISTEN) {
-		struct tcb *lt = t;
+		int mss;
 
 		if (flags == 0x2) {
-			uint irs;
-
-			irs = GET_32 (p + 44);
-			t = tcb_new (p + 24, lport, p + 8, rport);
-			t->inbuf = rb_new (16 * 1024);
-			t->outbuf = rb_new (16 * 1024);
-			t->state = TCP_SYN_RECVD;
-			t->rport = rport;
-			memcpy (t->raddr, p + 8, 16);
-			t->lport = GET_16 (p + 42);
-			memcpy (t->laddr, p + 24, 16);
-			t->irs = irs;
-			t->rcv_wnd = rb_left (t->inbuf);
-			t->read_seq = t->rcv_nxt = irs + 1;
-			rb_set (t->inbuf, t->rcv_nxt);
-			t->snd_nxt = t->snd_una = t->iss = next_isn ();
-			t->rtt_mark = t->snd_nxt - 1;
-			t->rtt_limit = t->snd_nxt + 1;
-			rb_set (t->outbuf, t->snd_nxt + 1);
-			t->mss = 1220;
-			t->snd_cwnd = 0;
-			t->snd_wnd = GET_16 (p + 54);
-			window_update (t);
-			t->cb = lt->cb;
+			mss = tcp_peer_mss (p, len);
+			if (globals.syn_cookie_threshold > 0 && half_open >= globals.syn_cookie_threshold) {
+				tcp_send_raw (p + 24, lport, p + 8, rport, syn_cookie_make (p, mss), GET_32 (p + 44) + 1, 0x12, 16 * 1024, 1216);
+				return 0;
+			}
+			t = tcp_new_session (t, p, TCP_SYN_RECVD, GET_32 (p + 44), next_isn (), mss, isn_floor);
+			if (!t)
+				tcp_fabricate_rst (p);
 
 			// incoming_session() may call tcp_accept directly,
 			// and may even tcp_close immediately
+			else
+				t->cb->incoming_session (t, &t->app_data, t->cold->fp);
+			return 0;
+		}
+
+		// the ACK completing a handshake we answered with a cookie
+		if ((flags & 0x16) == 0x10 && (mss = syn_cookie_check (p))) {
+			t = tcp_new_session (t, p, TCP_ESTABLISHED, GET_32 (p + 44) - 1, GET_32 (p + 48) - 1, mss, 0);
+			if (!t) {
+				tcp_fabricate_rst (p);
+				return 0;
+			}
+			t->cb->incoming_session (t, &t->app_data, t->cold->fp);
 
-			t->cb->incoming_session (t, &t->app_data, t->fp);
+			// the app may have refused it; if not, the ACK may carry data
+			t = tcb_find (p + 24, lport, p + 8, rport);
+			if (!t || t->state == TCP_LISTEN)
+				return 0;
+			if (t->cb)
+				t->cb->output_buffer_space (t->app_data, rb_left (t->outbuf));
 		}
-		else
+		else {
 			tcp_fabricate_rst (p);
-		return 0;
+			return 0;
+		}
 	}
 
 	if (flags & 0x4) {
-		if (t->fp)
-			fprintf (t->fp, "connection reset!\n");
+		TCB_TRACE (t, "connection reset!\n");
 		if (t->cb)
 			t->cb->closing (t->app_data, 1);
-		if (t->e_tcb_send)
-			remove_event (t->e_tcb_send);
-		if (t->e_timeout)
-			remove_event (t->e_timeout);
-		tcb_delete (t);
+		tcp_destroy (t);
 		return 0;
 	}
 
 	if (flags & 0x10) {
 		uint ack;
 		ack = GET_32 (p + 48);
+		t->persist_probes = 0;
+
+		// the peer saw congestion: halve cwnd once per window of data
+		if ((p[53] & 0x40) && (t->flags & TCB_F_ECN) && t->state != TCP_SYN_RECVD && (int) (ack - t->cwr_seq) >= 0) {
+			t->snd_cwnd = max_int (t->snd_cwnd / 2, t->mss);
+			t->cwr_seq = t->snd_nxt;
+			t->flags |= TCB_F_CWR;
+			window_update (t);
+			TCB_TRACE (t, "ECE, cwnd now %d\n", t->snd_cwnd);
+		}
+
 		if (ack > t->snd_una) {
 			if (t->snd_una <= t->rtt_mark && ack > t->rtt_mark) {
 				int diff;
 
-				diff = time_ago (&t->rtt_time);
-				if (t->fp)
-					fprintf (t->fp, "RTT=%d msec ", diff);
+				diff = time_ago (&t->cold->rtt_time);
+				TCB_TRACE (t, "RTT=%d msec ", diff);
 				if (t->srtt > 0)
 					t->srtt = (2 * diff + 8 * t->srtt + 5) / 10;
 				else
 					t->srtt = diff;
-				if (t->fp)
-					fprintf (t->fp, "SRTT=%d msec ", t->srtt);
+				TCB_TRACE (t, "SRTT=%d msec ", t->srtt);
 				if (diff > t->srtt)
 					t->sdev = (75 * t->sdev + 25 * (diff - t->srtt) + 50) / 100;
 				else
 					t->sdev = (75 * t->sdev + 25 * (t->srtt - diff) + 50) / 100;
-				if (t->fp)
-					fprintf (t->fp, "DEV=%d msec\n", t->sdev);
+				TCB_TRACE (t, "DEV=%d msec\n", t->sdev);
 			}
 
 			t->snd_una = ack;
@@ -523,18 +938,20 @@ handle_tcp (uchar * p, int len)
 			case TCP_ESTABLISHED:
 				rb_advance (t->outbuf, ack);
 				t->cb->output_buffer_space (t->app_data, rb_left (t->outbuf));
+				// release anything autocork was holding
+				if (rb_avail (t->outbuf, t->snd_nxt) > 0)
+					mark_for_if_write (t);
 				// fallthrough
 			case TCP_FIN_WAIT_1:
 			case TCP_CLOSING:
 			case TCP_LAST_ACK:
-				if (t->e_timeout && ack >= t->timeout_mark) {
+				if (t->e_timeout && !(t->flags & TCB_F_PERSIST) && ack >= t->timeout_mark) {
 					remove_event (t->e_timeout);
 					if (t->snd_una < t->snd_nxt)
 						set_timeout (t);
 					else
 						t->e_timeout = NULL;
-					if (t->fp)
-						fprintf (t->fp, "reset timeout timer\n");
+					TCB_TRACE (t, "reset timeout timer\n");
 					t->snd_cwnd += t->mss;
 					// don't call window_update here,
 					// we need to test if we're blocked
@@ -547,31 +964,21 @@ handle_tcp (uchar * p, int len)
 			switch (t->state) {
 			case TCP_SYN_RECVD:
 				t->state = TCP_ESTABLISHED;
-				if (t->fp)
-					fprintf (t->fp, "pkt connection accepted.\n");
+				--half_open;
+				TCB_TRACE (t, "pkt connection accepted.\n");
 				t->cb->output_buffer_space (t->app_data, rb_left (t->outbuf));
 				break;
 			case TCP_LAST_ACK:
-				if (t->e_tcb_send)
-					remove_event (t->e_tcb_send);
-				if (t->e_timeout)
-					remove_event (t->e_timeout);
-				if (t->fp)
-					fprintf (t->fp, "pkt connection closed.\n");
-				tcb_delete (t);
+				TCB_TRACE (t, "pkt connection closed.\n");
+				tcp_destroy (t);
 				return 0;
 			case TCP_FIN_WAIT_1:
 				if (rb_avail (t->outbuf, t->snd_nxt) == -1)
 					t->state = TCP_FIN_WAIT_2;
 				break;
 			case TCP_CLOSING:
-				if (rb_avail (t->outbuf, t->snd_nxt) == -1) {
-					time_ref tr;
-
-					t->state = TCP_TIME_WAIT;
-					time_future (&tr, 120000);
-					t->e_timeout = add_time_event (&tr, tcp_remove, t);
-				}
+				if (rb_avail (t->outbuf, t->snd_nxt) == -1)
+					tcp_time_wait (t);
 				return 0;
 			}
 	}
@@ -580,33 +987,40 @@ handle_tcp (uchar * p, int len)
 	if (GET_32 (p + 44) < t->rcv_nxt) {
 		if (t->state != TCP_SYN_RECVD) {
 			/* HACK - we need a better way to rexmit acks */
-			if (t->fp)
-				fprintf (t->fp, "acking duplicate/old packet!\n");
+			TCB_TRACE (t, "acking duplicate/old packet!\n");
 			--t->last_acked;
-			mark_for_if_write (t);
+			mark_for_ack (t);
 		}
 		return 0;
 	}
+	if (t->flags & TCB_F_ECN) {
+		if (p[53] & 0x80)
+			t->flags &= ~TCB_F_ECE;
+		// CE codepoint in the traffic class
+		if ((p[1] & 0x30) == 0x30 && len > 40 + 4 * (p[52] >> 4)) {
+			t->flags |= TCB_F_ECE;
+			mark_for_ack (t);
+		}
+	}
+
 	// start sending again if the window goes from zero to nonzero
 	t->snd_wnd = GET_16 (p + 54);
 	if (window_size (t) <= 0 && window_update (t) > 0) {
-		if (t->fp)
-			fprintf (t->fp, "window exists now!\n");
+		TCB_TRACE (t, "window exists now!\n");
 		mark_for_if_write (t);
 	}
 	else
 		window_update (t);
+	tcp_check_persist (t);
+
+	if (t->state == TCP_ESTABLISHED)
+		tcp_autotune (t);
 
 	switch (t->state) {
 	case TCP_FIN_WAIT_2:
 		if (tcp_recv_data (t, p, len)) {
-			time_ref tr;
-
-			if (t->fp)
-				fprintf (t->fp, "pkt connection closed.\n");
-			t->state = TCP_TIME_WAIT;
-			time_future (&tr, 120000);
-			t->e_timeout = add_time_event (&tr, tcp_remove, t);
+			TCB_TRACE (t, "pkt connection closed.\n");
+			tcp_time_wait (t);
 		}
 		break;
 	case TCP_FIN_WAIT_1:
@@ -635,23 +1049,61 @@ tcp_get_output_space (struct tcb *t)
 	return rb_left (t->outbuf);
 }
 
+static void
+tcp_sent (struct tcb *t)
+{
+	if (window_size (t) > 0)
+		mark_for_if_write (t);
+	else
+		tcp_check_persist (t);
+}
+
 int
 tcp_send (struct tcb *t, uchar * data, int len, int push)
 {
 	rb_write (t->outbuf, data, len);
-	if (window_size (t) > 0)
-		mark_for_if_write (t);
+	tcp_sent (t);
 	return 0;
 }
 
+/*
+ * tcp_send without the copy: fill in the free space of the output
+ * buffer described by tcp_send_spans, then hand over the byte count.
+ */
 int
-tcp_read (struct tcb *t, uchar * buf, int len)
+tcp_send_spans (struct tcb *t, struct iovec *iov, int niov, int max)
 {
-	int blocked;
+	return rb_write_spans (t->outbuf, iov, niov, max);
+}
+
+void
+tcp_send_commit (struct tcb *t, int len)
+{
+	rb_commit (t->outbuf, len);
+	tcp_sent (t);
+}
+
+static void
+tcp_consumed (struct tcb *t, int len, int blocked)
+{
+	t->read_seq += len;
+	rb_advance (t->inbuf, t->read_seq);
+	t->rcv_wnd = rcv_window (t);
 
 	// if we were blocked (win = 0) because the buffer was full,
 	// we need to make sure we send the peer a window update
 	// packet once we're unblocked
+	if (blocked) {
+		/* UGLY, UGLY HACK to force a window update */
+		--t->last_acked;
+		mark_for_ack (t);
+	}
+}
+
+int
+tcp_read (struct tcb *t, uchar * buf, int len)
+{
+	int blocked;
 
 	blocked = rb_left (t->inbuf) == 0;
 
@@ -659,35 +1111,41 @@ tcp_read (struct tcb *t, uchar * buf, int len)
 		len = rb_avail (t->inbuf, t->read_seq);
 
 	len = rb_read (t->inbuf, t->read_seq, buf, len);
+	tcp_consumed (t, len, blocked);
+	return len;
+}
 
-	t->read_seq += len;
-	rb_advance (t->inbuf, t->read_seq);
-	t->rcv_wnd = rb_left (t->inbuf);
-
-	if (blocked) {
-		/* UGLY, UGLY HACK to force a window update */
-		--t->last_acked;
-		mark_for_if_write (t);
-	}
+/*
+ * tcp_read without the copy: the unread data is described in place,
+ * and tcp_read_commit releases however much of it the caller used.
+ */
+int
+tcp_read_spans (struct tcb *t, struct iovec *iov, int niov, int max)
+{
+	return rb_read_spans (t->inbuf, t->read_seq, iov, niov, max);
+}
 
-	return len;
+void
+tcp_read_commit (struct tcb *t, int len)
+{
+	tcp_consumed (t, len, rb_left (t->inbuf) == 0);
 }
 
 static int
-do_tcb_write (struct event *e, void *d)
+tcp_xmit (struct tx_flow *f, int lane)
 {
-	struct tcb *t = d;
+	struct tcb *t = (struct tcb *) ((char *) f - offsetof (struct tcb, tx));
 
-	syslog (LOG_INFO, "do_tcb_write called for %p\n", d);
-
-	if (t->state == TCP_SYN_RECVD) {
-		tcp_send_syn (t);
-		t->e_tcb_send = NULL;
+	if (lane == SCHED_PRIO) {
+		if (t->state == TCP_SYN_RECVD) {
+			tcp_send_syn (t);
+			return 64;
+		}
+		return t->last_acked != t->rcv_nxt ? tcp_send_ack (t) : 0;
 	}
-	else if (!tcp_send_and_ack (t))
-		t->e_tcb_send = NULL;
-
-	return t->e_tcb_send != NULL;
+	if (t->state == TCP_SYN_RECVD)
+		return 0;
+	return tcp_send_and_ack (t);
 }
 
 struct tcb *
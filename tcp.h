@@ -24,6 +24,7 @@
 #define _TCP_H
 
 struct tcb;
+struct iovec;
 
 struct tcp_callback
 {
@@ -39,6 +40,10 @@ int tcp_accept (struct tcb *t);
 int tcp_close (struct tcb *t, int hard);
 int tcp_send (struct tcb *t, uchar * data, int len, int push);
 int tcp_read (struct tcb *t, uchar * buf, int len);
+int tcp_send_spans (struct tcb *t, struct iovec *iov, int niov, int max);
+void tcp_send_commit (struct tcb *t, int len);
+int tcp_read_spans (struct tcb *t, struct iovec *iov, int niov, int max);
+void tcp_read_commit (struct tcb *t, int len);
 int tcp_get_output_space (struct tcb *t);
 int tcp_set_output_notify_limit (struct tcb *t, int limit);
 uchar *tcp_get_raddr (struct tcb *t);
@@ -46,6 +51,7 @@ int tcp_get_rport (struct tcb *t);
 uchar *tcp_get_laddr (struct tcb *t);
 int tcp_get_lport (struct tcb *t);
 
+int handle_tcp (uchar * p, int len);
 void tcp_init (void);
 
 extern char const *const stname[];
@@ -0,0 +1,240 @@
+/*
+ *  timewait.c
+ *
+ *  ptrtd - Portable IPv6 TRT implementation
+ *
+ *  Copyright (C) 2001  Nathan Lutchansky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+
+#include "config.h"
+#include "defs.h"
+#include "util.h"
+#include "event.h"
+#include "timewait.h"
+
+/*
+ * Entries live in one array and are linked by index, which keeps them
+ * at 44 bytes.  Every entry gets the same lifetime, so insertion order
+ * is expiry order and a single timer on the oldest one is enough.
+ * Removed entries stay on the expiry list, marked dead by a hash link
+ * no entry can have, until they reach its head; that's also how they get
+ * back to the free list.
+ */
+
+static struct tw_entry *tw_pool = NULL;
+static uint tw_cap = 0;		/* entries allocated */
+static uint tw_max = 0;		/* hard limit, power of two */
+static uint *tw_hash = NULL;	/* tw_max chain heads */
+static uint tw_free = 0;
+static uint tw_head = 0, tw_tail = 0;
+static int tw_live = 0;
+static uchar tw_key[16];
+static struct event *e_expire = NULL;
+
+#define TW(i)		(tw_pool + (i) - 1)
+#define TW_DEAD		(~0U)	/* hnext of a removed entry, never an index */
+
+static uint
+tw_hash_tuple (uchar const *laddr4, int lport, uchar const *raddr, int rport)
+{
+	uchar k[24];
+
+	memcpy (k, raddr, 16);
+	memcpy (k + 16, laddr4, 4);
+	PUT_16 (k + 20, lport);
+	PUT_16 (k + 22, rport);
+	return (uint) siphash (tw_key, k, sizeof (k)) & (tw_max - 1);
+}
+
+static int
+tw_setup (void)
+{
+	int max = globals.timewait_max;
+
+	for (tw_max = 1; tw_max < max; tw_max <<= 1);
+	tw_hash = ALLOC (tw_max * sizeof (uint));
+	if (!tw_hash)
+		return -1;
+	memset (tw_hash, 0, tw_max * sizeof (uint));
+	random_bytes (tw_key, sizeof (tw_key));
+	return 0;
+}
+
+static void
+tw_unhash (uint i)
+{
+	struct tw_entry *tw = TW (i);
+	uint *pp;
+
+	pp = tw_hash + tw_hash_tuple (tw->laddr4, tw->lport, tw->raddr, tw->rport);
+	for (; *pp; pp = &TW (*pp)->hnext)
+		if (*pp == i) {
+			*pp = tw->hnext;
+			break;
+		}
+	tw->hnext = TW_DEAD;
+	--tw_live;
+}
+
+/* take the oldest entry off the expiry list and free it */
+static void
+tw_pop (void)
+{
+	uint i = tw_head;
+
+	if (TW (i)->hnext != TW_DEAD)
+		tw_unhash (i);
+	tw_head = TW (i)->fnext;
+	if (!tw_head)
+		tw_tail = 0;
+	TW (i)->hnext = tw_free;
+	tw_free = i;
+}
+
+static int
+tw_expire (struct event *e, void *d)
+{
+	time_ref tr;
+	uint now = time (NULL);
+
+	while (tw_head && (int) (TW (tw_head)->expire - now) <= 0)
+		tw_pop ();
+
+	if (!tw_head) {
+		e_expire = NULL;
+		return 0;
+	}
+	time_future (&tr, (TW (tw_head)->expire - now) * 1000);
+	resched_time_event (e, &tr);
+	return 1;
+}
+
+static uint
+tw_alloc (void)
+{
+	struct tw_entry *p;
+	uint i, n;
+
+	if (!tw_free && tw_cap < tw_max) {
+		n = tw_cap ? tw_cap * 2 : 1024;
+		if (n > tw_max)
+			n = tw_max;
+		p = realloc (tw_pool, n * sizeof (struct tw_entry));
+		if (p) {
+			tw_pool = p;
+			for (i = n; i > tw_cap; --i) {
+				TW (i)->hnext = tw_free;
+				tw_free = i;
+			}
+			tw_cap = n;
+		}
+	}
+
+	// table full, so the oldest connection gets cut short
+	if (!tw_free && tw_head)
+		tw_pop ();
+
+	i = tw_free;
+	if (i)
+		tw_free = TW (i)->hnext;
+	return i;
+}
+
+int
+tw_insert (uchar const *laddr, int lport, uchar const *raddr, int rport, uint snd_nxt, uint rcv_nxt)
+{
+	struct tw_entry *tw;
+	uint i, h;
+	time_ref tr;
+
+	if (memcmp (laddr, globals.prefix, 12))
+		return 0;
+	if (!tw_hash && tw_setup () < 0)
+		return 0;
+	if (!(i = tw_alloc ()))
+		return 0;
+
+	tw = TW (i);
+	memcpy (tw->raddr, raddr, 16);
+	memcpy (tw->laddr4, laddr + 12, 4);
+	tw->lport = lport;
+	tw->rport = rport;
+	tw->snd_nxt = snd_nxt;
+	tw->rcv_nxt = rcv_nxt;
+	tw->expire = time (NULL) + TW_TIMEOUT / 1000;
+
+	h = tw_hash_tuple (tw->laddr4, lport, raddr, rport);
+	tw->hnext = tw_hash[h];
+	tw_hash[h] = i;
+
+	tw->fnext = 0;
+	if (tw_tail)
+		TW (tw_tail)->fnext = i;
+	else
+		tw_head = i;
+	tw_tail = i;
+	++tw_live;
+
+	if (!e_expire) {
+		time_future (&tr, TW_TIMEOUT);
+		e_expire = add_time_event (&tr, tw_expire, NULL);
+	}
+	return 1;
+}
+
+struct tw_entry *
+tw_find (uchar const *laddr, int lport, uchar const *raddr, int rport)
+{
+	struct tw_entry *tw;
+	uint i;
+
+	if (!tw_live || memcmp (laddr, globals.prefix, 12))
+		return NULL;
+
+	for (i = tw_hash[tw_hash_tuple (laddr + 12, lport, raddr, rport)]; i; i = tw->hnext) {
+		tw = TW (i);
+		if (tw->lport == lport && tw->rport == rport && !memcmp (tw->laddr4, laddr + 12, 4) && !memcmp (tw->raddr, raddr, 16))
+			return tw;
+	}
+	return NULL;
+}
+
+void
+tw_remove (struct tw_entry *tw)
+{
+	tw_unhash (tw - tw_pool + 1);
+}
+
+void
+tw_laddr (struct tw_entry const *tw, uchar * laddr)
+{
+	memcpy (laddr, globals.prefix, 12);
+	memcpy (laddr + 12, tw->laddr4, 4);
+}
+
+int
+tw_count (void)
+{
+	return tw_live;
+}
@@ -0,0 +1,53 @@
+/*
+ *  timewait.h
+ *
+ *  ptrtd - Portable IPv6 TRT implementation
+ *
+ *  Copyright (C) 2001  Nathan Lutchansky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _TIMEWAIT_H
+#define _TIMEWAIT_H
+
+#include "defs.h"
+
+#define TW_TIMEOUT	120000	/* msec */
+
+/*
+ * What's left of a connection in TIME_WAIT.  The local address is
+ * always inside our prefix, so only its last four bytes are kept.
+ */
+struct tw_entry
+{
+	uchar raddr[16];
+	uchar laddr4[4];
+	unsigned short lport;
+	unsigned short rport;
+	uint snd_nxt;
+	uint rcv_nxt;
+	uint expire;		/* time_t, truncated */
+	uint hnext;		/* hash chain / free list, index + 1 */
+	uint fnext;		/* expiry order, index + 1 */
+};
+
+int tw_insert (uchar const *laddr, int lport, uchar const *raddr, int rport, uint snd_nxt, uint rcv_nxt);
+struct tw_entry *tw_find (uchar const *laddr, int lport, uchar const *raddr, int rport);
+void tw_remove (struct tw_entry *tw);
+void tw_laddr (struct tw_entry const *tw, uchar * laddr);
+int tw_count (void);
+
+#endif /* _TIMEWAIT_H */
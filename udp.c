@@ -41,30 +41,59 @@
 #include "icmp.h"
 #include "buffer.h"
 #include "udp.h"
+#include "frag.h"
 
 struct udp_socket
 {
-	struct udp_socket *next;
-	struct udp_socket *prev;
+	struct udp_socket *next;	/* hash chain */
 	uchar laddr[16];
 	int lport;
 	void *app_data;
 	struct udp_callback *cb;
 };
 
-static struct udp_socket *udp_list = NULL;
+/*
+ * Sockets are hashed by (laddr, lport).  An all-zero laddr matches any
+ * local address and lport 0 matches any port, so delivery tries the exact
+ * binding, then the port on any address, then the catch-all socket.
+ */
+#define UDP_HASH	256
+
+static struct udp_socket *udp_hash[UDP_HASH];
+static uchar udp_key[16];
+static int keyed = 0;
+static uchar const any_addr[16];
 
 extern struct iface *iface;
 
+static uint
+sock_hash (uchar const *laddr, int lport)
+{
+	uchar k[18];
+
+	memcpy (k, laddr, 16);
+	PUT_16 (k + 16, lport);
+	return (uint) siphash (udp_key, k, sizeof (k)) & (UDP_HASH - 1);
+}
+
+static struct udp_socket *
+find_sock (uchar const *laddr, int lport)
+{
+	struct udp_socket *us;
+
+	for (us = udp_hash[sock_hash (laddr, lport)]; us; us = us->next)
+		if (us->lport == lport && !memcmp (us->laddr, laddr, 16))
+			return us;
+	return NULL;
+}
+
 static void
 udp_remove_sock (struct udp_socket *us)
 {
-	if (us->next)
-		us->next->prev = us->prev;
-	if (us->prev)
-		us->prev->next = us->next;
-	if (udp_list == us)
-		udp_list = us->next;
+	struct udp_socket **pp;
+
+	for (pp = udp_hash + sock_hash (us->laddr, us->lport); *pp != us; pp = &(*pp)->next);
+	*pp = us->next;
 	FREE (us);
 }
 
@@ -72,69 +101,215 @@ int
 handle_udp (uchar * p, int len)
 {
 	struct udp_socket *us;
+	int lport = GET_16 (p + 42);
 
-	// real lookup goes here
-	us = udp_list;
-
-	if (!us)
+	if (!(us = find_sock (p + 24, lport)) && !(us = find_sock (any_addr, lport)) && !(us = find_sock (any_addr, 0)))
 		return 1;	// return "connection rejected"?
 
-	us->cb->incoming_packet (us->app_data, p + 48, len - 48, p + 24, GET_16 (p + 42), p + 8, GET_16 (p + 40));
+	us->cb->incoming_packet (us->app_data, p + 48, len - 48, p + 24, lport, p + 8, GET_16 (p + 40));
 	return 1;
 }
 
+/*
+ * Whether IPv6 packet p is a datagram for a socket bound to its
+ * destination port.  Such sockets come before the translators; the
+ * catch-all socket does not.
+ */
+int
+udp_bound (uchar const *p, int len)
+{
+	int lport;
+
+	if (len < 48 || p[6] != 17)
+		return 0;
+	lport = GET_16 (p + 42);
+	return find_sock (p + 24, lport) || find_sock (any_addr, lport);
+}
+
+/* NULL if (laddr, lport) is already bound */
 struct udp_socket *
 udp_open (struct udp_callback *cb, void *app_data, uchar * laddr, int lport)
 {
 	struct udp_socket *us;
+	uint h;
+
+	if (!keyed) {
+		random_bytes (udp_key, sizeof (udp_key));
+		keyed = 1;
+	}
+	if (!laddr)
+		laddr = (uchar *) any_addr;
+	if (find_sock (laddr, lport))
+		return NULL;
 
 	us = ALLOC (sizeof (struct udp_socket));
-	us->next = udp_list;
-	us->prev = NULL;
-	if (udp_list)
-		udp_list->prev = us;
-	udp_list = us;
-	if (laddr)
-		memcpy (us->laddr, laddr, 16);
-	else
-		memset (us->laddr, 0, 16);
+	memcpy (us->laddr, laddr, 16);
 	us->lport = lport;
 	us->cb = cb;
 	us->app_data = app_data;
+	h = sock_hash (laddr, lport);
+	us->next = udp_hash[h];
+	udp_hash[h] = us;
 	return us;
 }
 
+#define UDP_MAX		(65535 - 8)	/* payload that fits the IPv6 length field */
+
+static void
+udp_fill (uchar * d, uchar * data, int len, uchar * laddr, int lport, uchar * raddr, int rport)
+{
+	int sum;
+
+	memcpy (d + 48, data, len);
+
+	memset (d, 0, 48);
+	d[0] = 0x60;		//version
+	PUT_16 (d + 4, len + 8);
+	d[6] = 17;		//udp
+	d[7] = 0x40;		//ttl
+	memcpy (d + 8, laddr, 16);
+	memcpy (d + 24, raddr, 16);
+	PUT_16 (d + 40, lport);
+	PUT_16 (d + 42, rport);
+	PUT_16 (d + 44, len + 8);
+
+	sum = ~make_cksum (d, len + 48);
+	PUT_16 (d + 46, sum);
+}
+
+/* the datagram as one packet, or as a chain of fragments if it's over the MTU */
+static struct pbuf *
+udp_build (uchar * data, int len, uchar * laddr, int lport, uchar * raddr, int rport)
+{
+	static uchar *big = NULL;
+	struct pbuf *p;
+
+	if (len > UDP_MAX)
+		len = UDP_MAX;
+	if (len + 48 <= iface->mtu) {
+		p = iface->get_buffer (iface, len + 48);
+		udp_fill (p->d, data, len, laddr, lport, raddr, rport);
+		p->dlen = len + 48;
+		p->next = NULL;
+		return p;
+	}
+
+	if (!big)
+		big = ALLOC (UDP_MAX + 48);
+	udp_fill (big, data, len, laddr, lport, raddr, rport);
+	return frag_split (iface, big, len + 48);
+}
+
 int
 udp_send (struct udp_socket *us, uchar * data, int len, uchar * laddr, int lport, uchar * raddr, int rport)
 {
-	int sum;
+	struct pbuf *p, *next;
+
+	if (len > UDP_MAX)
+		len = UDP_MAX;
+	for (p = udp_build (data, len, laddr, lport, raddr, rport); p; p = next) {
+		next = p->next;
+		p->next = NULL;
+		send_pkt (iface, p);
+	}
+	return len;
+}
+
+#define UDP_QUEUE_MAX	1024	/* packets (fragments) waiting per flow before we drop */
+
+static int udp_drops = 0;	/* datagrams dropped on full flow queues */
+
+static int
+udp_xmit (struct tx_flow *f, int lane)
+{
+	struct udp_flow *uf = (struct udp_flow *) f;
 	struct pbuf *p;
+	int sent;
 
-	p = iface->get_buffer (iface, 1280);
-	if (len > 1280 - 48)
-		len = 1280 - 48;
-	memcpy (p->d + 48, data, len);
-
-	memset (p->d, 0, 48);
-	p->d[0] = 0x60;		//version
-	PUT_16 (p->d + 4, len + 8);
-	p->d[6] = 17;		//udp
-	p->d[7] = 0x40;		//ttl
-	memcpy (p->d + 8, laddr, 16);
-	memcpy (p->d + 24, raddr, 16);
-	PUT_16 (p->d + 40, lport);
-	PUT_16 (p->d + 42, rport);
-	PUT_16 (p->d + 44, len + 8);
-
-	sum = ~make_cksum (p->d, len + 48);
-	PUT_16 (p->d + 46, sum);
-
-	p->dlen = len + 48;
+	if (!(p = uf->head))
+		return 0;
+	if (!(uf->head = p->next))
+		uf->tail = NULL;
+	--uf->queued;
+	p->next = NULL;
+	sent = p->dlen;
 	send_pkt (iface, p);
+	return sent;
+}
 
+void
+udp_flow_init (struct udp_flow *uf)
+{
+	sched_init_flow (&uf->tx, udp_xmit);
+	uf->head = uf->tail = NULL;
+	uf->queued = 0;
+}
+
+/*
+ * Like udp_send, but the datagram waits for the flow's turn in the
+ * transmit scheduler.  Returns 0 if it was dropped on a full queue.
+ */
+int
+udp_flow_send (struct udp_flow *uf, uchar * data, int len, uchar * laddr, int lport, uchar * raddr, int rport)
+{
+	struct pbuf *p, *last;
+	int n;
+
+	if (uf->queued >= UDP_QUEUE_MAX) {
+		++udp_drops;
+		return 0;
+	}
+	if (len > UDP_MAX)
+		len = UDP_MAX;
+	p = udp_build (data, len, laddr, lport, raddr, rport);
+	for (n = 1, last = p; last->next; last = last->next)
+		++n;
+	// fragments of one datagram go all or nothing
+	if (uf->queued + n > UDP_QUEUE_MAX) {
+		for (; p; p = last) {
+			last = p->next;
+			pbuf_delete (p);
+		}
+		++udp_drops;
+		return 0;
+	}
+	if (uf->tail)
+		uf->tail->next = p;
+	else
+		uf->head = p;
+	uf->tail = last;
+	uf->queued += n;
+	sched_wake (&uf->tx, SCHED_BULK);
 	return len;
 }
 
+/* packets uf can still queue */
+int
+udp_flow_room (struct udp_flow *uf)
+{
+	return UDP_QUEUE_MAX - uf->queued;
+}
+
+int
+udp_flow_drops (void)
+{
+	return udp_drops;
+}
+
+void
+udp_flow_cancel (struct udp_flow *uf)
+{
+	struct pbuf *p;
+
+	sched_cancel (&uf->tx);
+	while ((p = uf->head)) {
+		uf->head = p->next;
+		pbuf_delete (p);
+	}
+	uf->tail = NULL;
+	uf->queued = 0;
+}
+
 int
 udp_close (struct udp_socket *us)
 {
@@ -23,8 +23,19 @@
 #ifndef _UDP_H
 #define _UDP_H
 
+#include "sched.h"
+
 struct udp_socket;
 
+/* return traffic of one mapping, queued for the transmit scheduler */
+struct udp_flow
+{
+	struct tx_flow tx;
+	struct pbuf *head;
+	struct pbuf *tail;
+	int queued;
+};
+
 struct udp_callback
 {
 	void (*incoming_packet) (void *d, uchar * data, int len, uchar * laddr, int lport, uchar * raddr, int rport);
@@ -33,6 +44,12 @@ struct udp_callback
 struct udp_socket *udp_open (struct udp_callback *cb, void *app_data, uchar * laddr, int lport);
 int udp_close (struct udp_socket *us);
 int udp_send (struct udp_socket *us, uchar * data, int len, uchar * laddr, int lport, uchar * raddr, int rport);
+void udp_flow_init (struct udp_flow *uf);
+int udp_flow_send (struct udp_flow *uf, uchar * data, int len, uchar * laddr, int lport, uchar * raddr, int rport);
+void udp_flow_cancel (struct udp_flow *uf);
+int udp_flow_room (struct udp_flow *uf);
+int udp_flow_drops (void);
+int udp_bound (uchar const *p, int len);
 uchar *udp_get_laddr (struct udp_socket *us);
 int udp_get_lport (struct udp_socket *us);
 
@@ -26,6 +26,8 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <sys/time.h>
 
 #include "config.h"
 #include "util.h"
@@ -123,7 +125,8 @@ int
 make_cksum (uchar * p, int len)
 {
 	int i;
-	int c = GET_16 (p + 4) + p[6];
+	// wide enough for a 64 KB datagram of 0xff bytes
+	unsigned long long c = GET_16 (p + 4) + p[6];
 
 	for (i = 0x8; i < len; ++i)
 		c += (i % 2) ? p[i] : (p[i] << 8);
@@ -131,3 +134,76 @@ make_cksum (uchar * p, int len)
 		c = (c >> 16) + (c & 0xffff);
 	return c;
 }
+
+void
+random_bytes (uchar * buf, int len)
+{
+	struct timeval tv;
+	int fd, i, got = 0;
+
+	if ((fd = open ("/dev/urandom", O_RDONLY)) >= 0) {
+		got = read (fd, buf, len);
+		close (fd);
+	}
+	if (got == len)
+		return;
+
+	/* no urandom; better than nothing */
+	gettimeofday (&tv, NULL);
+	srandom (tv.tv_sec ^ tv.tv_usec ^ (getpid () << 16));
+	for (i = 0; i < len; ++i)
+		buf[i] = random () >> 7;
+}
+
+#define ROTL64(x,b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND(v0,v1,v2,v3) do { \
+	v0 += v1; v1 = ROTL64 (v1, 13); v1 ^= v0; v0 = ROTL64 (v0, 32); \
+	v2 += v3; v3 = ROTL64 (v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = ROTL64 (v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = ROTL64 (v1, 17); v1 ^= v2; v2 = ROTL64 (v2, 32); \
+} while (0)
+
+static unsigned long long
+get_le64 (uchar const *p)
+{
+	unsigned long long v = 0;
+	int i;
+
+	for (i = 7; i >= 0; --i)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+/* SipHash-2-4 with a 16 byte key.  Used wherever a remote host gets to
+ * pick the input of a hash table or a cookie, so it can't aim for
+ * collisions. */
+unsigned long long
+siphash (uchar const *key, uchar const *data, int len)
+{
+	unsigned long long k0 = get_le64 (key), k1 = get_le64 (key + 8);
+	unsigned long long v0 = k0 ^ 0x736f6d6570736575ULL;
+	unsigned long long v1 = k1 ^ 0x646f72616e646f6dULL;
+	unsigned long long v2 = k0 ^ 0x6c7967656e657261ULL;
+	unsigned long long v3 = k1 ^ 0x7465646279746573ULL;
+	unsigned long long m, b = ((unsigned long long) len) << 56;
+	int i;
+
+	for (; len >= 8; len -= 8, data += 8) {
+		m = get_le64 (data);
+		v3 ^= m;
+		SIPROUND (v0, v1, v2, v3);
+		SIPROUND (v0, v1, v2, v3);
+		v0 ^= m;
+	}
+	for (i = 0; i < len; ++i)
+		b |= ((unsigned long long) data[i]) << (8 * i);
+
+	v3 ^= b;
+	SIPROUND (v0, v1, v2, v3);
+	SIPROUND (v0, v1, v2, v3);
+	v0 ^= b;
+	v2 ^= 0xff;
+	for (i = 0; i < 4; ++i)
+		SIPROUND (v0, v1, v2, v3);
+	return v0 ^ v1 ^ v2 ^ v3;
+}
@@ -41,5 +41,7 @@ int ip6tostr (char *str, int size, uchar const *addr);
 int strtoip6 (uchar * addr, char const *str);
 int make_cksum (uchar * p, int len);
 int max_int (int a, int b);
+void random_bytes (uchar * buf, int len);
+unsigned long long siphash (uchar const *key, uchar const *data, int len);
 
 #endif /* _UTIL_H */
@@ -0,0 +1,413 @@
+/*
+ *  xlat.c
+ *
+ *  ptrtd - Portable IPv6 TRT implementation
+ *
+ *  Copyright (C) 2001  Nathan Lutchansky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+#include "defs.h"
+#include "util.h"
+#include "xlat.h"
+
+/*
+ * Stateless IP/ICMP translation (RFC 7915) between the prefix and IPv4.
+ * An IPv6 address under the prefix maps to the IPv4 address in its last
+ * 32 bits, the same embedding the terminating path uses, so a packet
+ * whose source and destination are both under the prefix can be turned
+ * into an IPv4 packet by rewriting its header in place, and back.  The
+ * TCP and UDP checksums are adjusted incrementally (RFC 1624) for the
+ * pseudo-header change; ICMP echo is re-summed since ICMPv6 covers a
+ * pseudo-header and ICMPv4 doesn't.  ICMPv4 destination unreachable
+ * (fragmentation needed included) and time exceeded become their ICMPv6
+ * counterparts, along with the packet they quote, so path MTU discovery
+ * works across.
+ *
+ * Not translated: IPv6 extension headers and IPv4 fragments (passed or
+ * dropped), IPv4 options (stripped), ICMPv4 parameter problems and
+ * ICMPv6 errors.
+ */
+
+#define ICMP4_ECHO_REPLY	0
+#define ICMP4_UNREACH		3
+#define ICMP4_ECHO		8
+#define ICMP4_TIME_EXCEEDED	11
+#define ICMP6_UNREACH		1
+#define ICMP6_TOO_BIG		2
+#define ICMP6_TIME_EXCEEDED	3
+#define ICMP6_PARAM		4
+#define ICMP6_ECHO		128
+#define ICMP6_ECHO_REPLY	129
+
+#define XLAT_ERR_MAX		1280	/* an ICMPv6 error fits the minimum MTU */
+#define XLAT_DF_MIN		1260	/* smaller IPv4 packets may be fragmented (RFC 7915 5.1) */
+
+static uint
+sum16 (uchar const *p, int len)
+{
+	uint c = 0;
+
+	for (; len > 1; p += 2, len -= 2)
+		c += (p[0] << 8) | p[1];
+	if (len)
+		c += p[0] << 8;
+	return c;
+}
+
+static uint
+fold (uint c)
+{
+	while (c > 0xffff)
+		c = (c >> 16) + (c & 0xffff);
+	return c;
+}
+
+/* HC' = ~(~HC + ~m + m') for a field whose covered words summed to old and now to new */
+static void
+cksum_adjust (uchar * field, uint old, uint new)
+{
+	uint c;
+
+	c = (~GET_16 (field) & 0xffff) + (~fold (old) & 0xffff) + fold (new);
+	PUT_16 (field, ~fold (c) & 0xffff);
+}
+
+/* fix up the checksum at field for len (even) covered bytes changing from old to new */
+void
+xlat_cksum_update (uchar * field, uchar const *old, uchar const *new, int len)
+{
+	cksum_adjust (field, sum16 (old, len), sum16 (new, len));
+}
+
+static int
+prefixed (uchar const *addr)
+{
+	return memcmp (addr, globals.prefix, 12) == 0;
+}
+
+int
+xlat_6to4 (struct pbuf *p)
+{
+	if (p->dlen < 40 || !prefixed (p->d + 8) || !prefixed (p->d + 24))
+		return XLAT_PASS;
+	return xlat_6to4_addr (p, p->d + 20, p->d + 36);
+}
+
+/* translate with the given IPv4 source and destination */
+int
+xlat_6to4_addr (struct pbuf *p, uchar const *src4, uchar const *dst4)
+{
+	uchar *d = p->d, *l4 = p->d + 40;
+	uchar hdr[20], addr4[8];
+	int plen, proto;
+
+	memcpy (addr4, src4, 4);
+	memcpy (addr4 + 4, dst4, 4);
+	plen = GET_16 (d + 4);
+	if (plen + 40 > p->dlen || plen + 20 > 65535 || d[7] <= 1)
+		return XLAT_DROP;
+	p->dlen = plen + 40;
+
+	proto = d[6];
+	switch (proto) {
+	case 6:
+		if (plen < 20)
+			return XLAT_DROP;
+		cksum_adjust (l4 + 16, sum16 (d + 8, 32), sum16 (addr4, 8));
+		break;
+	case 17:
+		if (plen < 8)
+			return XLAT_DROP;
+		cksum_adjust (l4 + 6, sum16 (d + 8, 32), sum16 (addr4, 8));
+		if (GET_16 (l4 + 6) == 0)
+			PUT_16 (l4 + 6, 0xffff);
+		break;
+	case 58:
+		if (plen < 8 || (l4[0] != ICMP6_ECHO && l4[0] != ICMP6_ECHO_REPLY))
+			return XLAT_PASS;
+		l4[0] = l4[0] == ICMP6_ECHO ? ICMP4_ECHO : ICMP4_ECHO_REPLY;
+		PUT_16 (l4 + 2, 0);
+		PUT_16 (l4 + 2, ~fold (sum16 (l4, plen)) & 0xffff);
+		proto = 1;
+		break;
+	default:
+		// extension headers and anything else stay on the old path
+		return XLAT_PASS;
+	}
+
+	hdr[0] = 0x45;
+	hdr[1] = (d[0] << 4) | (d[1] >> 4);	// traffic class
+	PUT_16 (hdr + 2, plen + 20);
+	PUT_16 (hdr + 4, 0);	// id
+	// DF only where the IPv6 side could have used the path MTU, so
+	// "fragmentation needed" comes back for those and gets translated
+	PUT_16 (hdr + 6, plen + 20 > XLAT_DF_MIN ? 0x4000 : 0);
+	hdr[8] = d[7] - 1;
+	hdr[9] = proto;
+	PUT_16 (hdr + 10, 0);
+	memcpy (hdr + 12, addr4, 8);
+	PUT_16 (hdr + 10, ~fold (sum16 (hdr, 20)) & 0xffff);
+
+	memcpy (d + 20, hdr, 20);
+	pbuf_drop (p, 20);
+	return XLAT_DONE;
+}
+
+int
+xlat_4to6 (struct pbuf *p)
+{
+	uchar src6[16], dst6[16], isrc6[16], idst6[16];
+	uchar const *inner;
+	int ihl;
+
+	if (p->dlen < 20)
+		return XLAT_DROP;
+	memcpy (src6, globals.prefix, 12);
+	memcpy (src6 + 12, p->d + 12, 4);
+	memcpy (dst6, globals.prefix, 12);
+	memcpy (dst6 + 12, p->d + 16, 4);
+	if ((ihl = xlat_icmp_error (p)) > 0) {
+		inner = p->d + ihl + 8;
+		memcpy (isrc6, globals.prefix, 12);
+		memcpy (isrc6 + 12, inner + 12, 4);
+		memcpy (idst6, globals.prefix, 12);
+		memcpy (idst6 + 12, inner + 16, 4);
+		return xlat_icmp_4to6 (p, src6, dst6, isrc6, idst6);
+	}
+	return xlat_4to6_addr (p, src6, dst6);
+}
+
+/*
+ * If p is an ICMPv4 error that can be translated and quotes at least
+ * an IPv4 header and 8 bytes past it, the offset of the ICMP header;
+ * else 0.
+ */
+int
+xlat_icmp_error (struct pbuf const *p)
+{
+	uchar const *d = p->d, *icmp, *inner;
+	int ihl, len;
+
+	if (p->dlen < 20 || (d[0] >> 4) != 4 || d[9] != 1)
+		return 0;
+	ihl = (d[0] & 0xf) * 4;
+	len = GET_16 (d + 2);
+	if (ihl < 20 || len > p->dlen || len < ihl + 8 + 20 + 8 || (GET_16 (d + 6) & 0x3fff) || fold (sum16 (d, ihl)) != 0xffff)
+		return 0;
+	icmp = d + ihl;
+	if (icmp[0] != ICMP4_UNREACH && icmp[0] != ICMP4_TIME_EXCEEDED)
+		return 0;
+	inner = icmp + 8;
+	if ((inner[0] >> 4) != 4 || (inner[0] & 0xf) < 5 || len < ihl + 8 + (inner[0] & 0xf) * 4 + 8)
+		return 0;
+	return ihl;
+}
+
+/* type, code and the 32 bits after the checksum of the ICMPv6 error for icmp; -1 to drop it */
+static int
+icmp_error_type (uchar const *icmp, int *code, uint * extra)
+{
+	int mtu;
+
+	*extra = 0;
+	if (icmp[0] == ICMP4_TIME_EXCEEDED) {
+		*code = icmp[1];
+		return icmp[1] <= 1 ? ICMP6_TIME_EXCEEDED : -1;
+	}
+	switch (icmp[1]) {
+	case 0:		// net, host
+	case 1:
+	case 5:		// source route failed
+	case 6:		// unknown net, host
+	case 7:
+	case 8:
+	case 11:	// for TOS
+	case 12:
+		*code = 0;
+		return ICMP6_UNREACH;
+	case 9:		// administratively prohibited
+	case 10:
+	case 13:
+	case 15:
+		*code = 1;
+		return ICMP6_UNREACH;
+	case 2:		// protocol: points at the next header field
+		*code = 1;
+		*extra = 6;
+		return ICMP6_PARAM;
+	case 3:
+		*code = 4;
+		return ICMP6_UNREACH;
+	case 4:		// fragmentation needed
+		*code = 0;
+		mtu = GET_16 (icmp + 6) + 20;
+		*extra = mtu > 1280 ? mtu : 1280;
+		return ICMP6_TOO_BIG;
+	}
+	return -1;
+}
+
+/*
+ * Translate the ICMPv4 error p (xlat_icmp_error said yes) with outer
+ * addresses src6/dst6, and the packet it quotes with isrc6/idst6.  The
+ * quoted packet's transport checksum follows its pseudo-header as far
+ * as it was quoted.  The result is cut to XLAT_ERR_MAX bytes.
+ */
+int
+xlat_icmp_4to6 (struct pbuf *p, uchar const *src6, uchar const *dst6, uchar const *isrc6, uchar const *idst6)
+{
+	uchar out[XLAT_ERR_MAX], *il4;
+	uchar const *d = p->d, *icmp, *inner;
+	int ihl, iihl, len, ilen, iproto, type, code, ck = 0;
+	uint extra, ps;
+
+	ihl = (d[0] & 0xf) * 4;
+	len = GET_16 (d + 2);
+	icmp = d + ihl;
+	inner = icmp + 8;
+	iihl = (inner[0] & 0xf) * 4;
+	iproto = inner[9];
+	if (d[8] <= 1 || (type = icmp_error_type (icmp, &code, &extra)) < 0)
+		return XLAT_DROP;
+	ilen = len - ihl - 8 - iihl;	// quoted transport bytes
+	if (ilen > XLAT_ERR_MAX - 88)
+		ilen = XLAT_ERR_MAX - 88;
+
+	// the quoted packet, as it would have looked on the IPv6 side
+	memset (out + 48, 0, 8);
+	out[48] = 0x60 | (inner[1] >> 4);
+	out[49] = inner[1] << 4;
+	PUT_16 (out + 52, GET_16 (inner + 2) - iihl);
+	out[54] = iproto == 1 ? 58 : iproto;
+	out[55] = inner[8];
+	memcpy (out + 56, isrc6, 16);
+	memcpy (out + 72, idst6, 16);
+	il4 = out + 88;
+	memcpy (il4, inner + iihl, ilen);
+	ps = sum16 (isrc6, 16) + sum16 (idst6, 16) + GET_16 (out + 52);
+	switch (iproto) {
+	case 6:
+		if (ilen >= 18)
+			cksum_adjust (il4 + 16, sum16 (inner + 12, 8), sum16 (out + 56, 32));
+		break;
+	case 17:
+		if (GET_16 (il4 + 6))
+			cksum_adjust (il4 + 6, sum16 (inner + 12, 8), sum16 (out + 56, 32));
+		break;
+	case 1:
+		if (il4[0] == ICMP4_ECHO || il4[0] == ICMP4_ECHO_REPLY) {
+			ck = GET_16 (il4);
+			il4[0] = il4[0] == ICMP4_ECHO ? ICMP6_ECHO : ICMP6_ECHO_REPLY;
+			cksum_adjust (il4 + 2, ck, GET_16 (il4) + ps + 58);
+		}
+		break;
+	}
+
+	// and the error around it
+	memset (out, 0, 48);
+	out[0] = 0x60 | (d[1] >> 4);
+	out[1] = d[1] << 4;
+	PUT_16 (out + 4, 48 + ilen);
+	out[6] = 58;
+	out[7] = d[8] - 1;
+	memcpy (out + 8, src6, 16);
+	memcpy (out + 24, dst6, 16);
+	out[40] = type;
+	out[41] = code;
+	PUT_32 (out + 44, extra);
+	PUT_16 (out + 42, ~make_cksum (out, 88 + ilen) & 0xffff);
+
+	len = 88 + ilen - p->dlen;
+	if ((len > 0 ? pbuf_raise (p, len) : pbuf_drop (p, -len)) < 0)
+		return XLAT_DROP;
+	memcpy (p->d, out, 88 + ilen);
+	return XLAT_DONE;
+}
+
+/* translate with the given IPv6 source and destination */
+int
+xlat_4to6_addr (struct pbuf *p, uchar const *src6, uchar const *dst6)
+{
+	uchar *d = p->d, *l4;
+	uchar hdr[40];
+	int ihl, len, plen, proto, full = 0;
+
+	if (p->dlen < 20 || (d[0] >> 4) != 4)
+		return XLAT_DROP;
+	ihl = (d[0] & 0xf) * 4;
+	len = GET_16 (d + 2);
+	if (ihl < 20 || len < ihl || len > p->dlen || fold (sum16 (d, ihl)) != 0xffff || d[8] <= 1)
+		return XLAT_DROP;
+	if (GET_16 (d + 6) & 0x3fff)	// MF or an offset
+		return XLAT_DROP;
+	p->dlen = len;
+
+	l4 = d + ihl;
+	plen = len - ihl;
+	proto = d[9];
+
+	memset (hdr, 0, 40);
+	hdr[0] = 0x60 | (d[1] >> 4);
+	hdr[1] = d[1] << 4;
+	PUT_16 (hdr + 4, plen);
+	hdr[6] = proto == 1 ? 58 : proto;
+	hdr[7] = d[8] - 1;
+	memcpy (hdr + 8, src6, 16);
+	memcpy (hdr + 24, dst6, 16);
+
+	switch (proto) {
+	case 6:
+		if (plen < 20)
+			return XLAT_DROP;
+		cksum_adjust (l4 + 16, sum16 (d + 12, 8), sum16 (hdr + 8, 32));
+		break;
+	case 17:
+		if (plen < 8)
+			return XLAT_DROP;
+		// IPv6 has no checksum-less UDP
+		if (GET_16 (l4 + 6) == 0)
+			full = 6;
+		else
+			cksum_adjust (l4 + 6, sum16 (d + 12, 8), sum16 (hdr + 8, 32));
+		break;
+	case 1:
+		if (plen < 8 || (l4[0] != ICMP4_ECHO && l4[0] != ICMP4_ECHO_REPLY))
+			return XLAT_DROP;
+		l4[0] = l4[0] == ICMP4_ECHO ? ICMP6_ECHO : ICMP6_ECHO_REPLY;
+		full = 2;
+		break;
+	default:
+		return XLAT_DROP;
+	}
+
+	if (pbuf_raise (p, 40 - ihl) < 0)
+		return XLAT_DROP;
+	memcpy (p->d, hdr, 40);
+	if (full) {
+		PUT_16 (l4 + full, 0);
+		PUT_16 (l4 + full, ~make_cksum (p->d, p->dlen) & 0xffff);
+		if (proto == 17 && GET_16 (l4 + 6) == 0)
+			PUT_16 (l4 + 6, 0xffff);
+	}
+	return XLAT_DONE;
+}
@@ -0,0 +1,40 @@
+/*
+ *  xlat.h
+ *
+ *  ptrtd - Portable IPv6 TRT implementation
+ *
+ *  Copyright (C) 2001  Nathan Lutchansky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _XLAT_H
+#define _XLAT_H
+
+#include "pbuf.h"
+
+#define XLAT_DONE	0	/* rewritten in place, ready for the other side */
+#define XLAT_PASS	1	/* not for the translator, handle it as before */
+#define XLAT_DROP	-1
+
+int xlat_6to4 (struct pbuf *p);
+int xlat_4to6 (struct pbuf *p);
+int xlat_6to4_addr (struct pbuf *p, uchar const *src4, uchar const *dst4);
+int xlat_4to6_addr (struct pbuf *p, uchar const *src6, uchar const *dst6);
+int xlat_icmp_error (struct pbuf const *p);
+int xlat_icmp_4to6 (struct pbuf *p, uchar const *src6, uchar const *dst6, uchar const *isrc6, uchar const *idst6);
+void xlat_cksum_update (uchar * field, uchar const *old, uchar const *new, int len);
+
+#endif /* _XLAT_H */